@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ufs
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Directory entry cache: (directory inode, name) -> inode.
+ *
+ * Path resolution looks every component up here before scanning the
+ * directory.  Misses are cached too, as entries with inode 0, so that
+ * probing for names that do not exist costs no I/O either.  The
+ * directory operations keep it coherent: adding a name enters it,
+ * removing one turns it into a negative entry, and freeing a directory
+ * inode forgets everything cached under it.  Names longer than
+ * DCACHE_NAMELEN are never cached.  At most dcache_max entries are
+ * kept, the least recently used being reclaimed first.
+ */
+
+#include "fuse-ufs.h"
+
+#define DCACHE_NAMELEN 39	/* an entry fits two cache lines */
+
+struct dcache_entry {
+	struct dcache_entry *de_next;	/* hash chain */
+	TAILQ_ENTRY(dcache_entry) de_lru;	/* most recently used first */
+	uufsd_t	*de_ufs;
+	ino_t	de_dir;
+	ino_t	de_ino;			/* 0 for a negative entry */
+	u_int32_t de_hash;
+	u_int8_t de_namlen;
+	char	de_name[DCACHE_NAMELEN];
+};
+
+static TAILQ_HEAD(dcache_lru, dcache_entry) dcache_lru =
+	TAILQ_HEAD_INITIALIZER(dcache_lru);
+static struct dcache_entry **dcache_head;
+static u_int32_t dcache_mask;
+static int dcache_max = UFS_DEF_DENTRY_CACHE;
+static struct ufs_slab dcache_slab;
+static struct dcache_stats dcache_st;
+
+static u_int32_t dcache_hash(uufsd_t *ufs, ino_t dir, const char *name, int len)
+{
+	u_int64_t h = 0xcbf29ce484222325ULL ^ (u_int64_t)(uintptr_t)ufs;
+	int i;
+
+	/* FNV-1a over the name, seeded with the disk and the directory */
+	h = (h ^ dir) * 0x100000001b3ULL;
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+	}
+	return (u_int32_t)(h ^ (h >> 32));
+}
+
+void dcache_init (int max)
+{
+	u_int32_t size;
+
+	dcache_max = max < 0 ? 0 : max;
+	if (dcache_max == 0 || dcache_head != NULL) {
+		return;
+	}
+	for (size = 64; size < (u_int32_t)dcache_max; size <<= 1)
+		;
+	dcache_head = calloc(size, sizeof(*dcache_head));
+	if (dcache_head == NULL) {
+		dcache_max = 0;
+		return;
+	}
+	dcache_mask = size - 1;
+	ufs_slab_init(&dcache_slab, sizeof(struct dcache_entry));
+}
+
+static struct dcache_entry *dcache_find(uufsd_t *ufs, ino_t dir,
+	const char *name, int len, u_int32_t hash)
+{
+	struct dcache_entry *de;
+
+	for (de = dcache_head[hash & dcache_mask]; de != NULL; de = de->de_next) {
+		if (de->de_hash == hash && de->de_dir == dir &&
+		    de->de_ufs == ufs && de->de_namlen == len &&
+		    memcmp(de->de_name, name, len) == 0) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+static void dcache_free(struct dcache_entry *de)
+{
+	struct dcache_entry **pp = &dcache_head[de->de_hash & dcache_mask];
+
+	while (*pp != de) {
+		pp = &(*pp)->de_next;
+	}
+	*pp = de->de_next;
+	TAILQ_REMOVE(&dcache_lru, de, de_lru);
+	ufs_slab_free(&dcache_slab, de);
+	dcache_st.ds_entries--;
+}
+
+/*
+ * Returns 1 and the cached inode (0 if the name is known not to exist)
+ * on a hit, 0 when the directory has to be searched.
+ */
+int dcache_lookup (uufsd_t *ufs, ino_t dir, const char *name, int len,
+	ino_t *ino)
+{
+	struct dcache_entry *de;
+
+	if (dcache_head == NULL || len > DCACHE_NAMELEN) {
+		return 0;
+	}
+	de = dcache_find(ufs, dir, name, len, dcache_hash(ufs, dir, name, len));
+	if (de == NULL) {
+		dcache_st.ds_misses++;
+		return 0;
+	}
+	if (de->de_ino) {
+		dcache_st.ds_hits++;
+	} else {
+		dcache_st.ds_neghits++;
+	}
+	TAILQ_REMOVE(&dcache_lru, de, de_lru);
+	TAILQ_INSERT_HEAD(&dcache_lru, de, de_lru);
+	*ino = de->de_ino;
+	return 1;
+}
+
+/*
+ * Record that name in dir is ino, or that it does not exist if ino is 0.
+ */
+void dcache_enter (uufsd_t *ufs, ino_t dir, const char *name, int len,
+	ino_t ino)
+{
+	struct dcache_entry *de;
+	u_int32_t hash;
+
+	if (dcache_head == NULL || len > DCACHE_NAMELEN) {
+		return;
+	}
+	hash = dcache_hash(ufs, dir, name, len);
+	de = dcache_find(ufs, dir, name, len, hash);
+	if (de != NULL) {
+		de->de_ino = ino;
+		TAILQ_REMOVE(&dcache_lru, de, de_lru);
+		TAILQ_INSERT_HEAD(&dcache_lru, de, de_lru);
+		return;
+	}
+	if (dcache_st.ds_entries >= (size_t)dcache_max) {
+		dcache_free(TAILQ_LAST(&dcache_lru, dcache_lru));
+		dcache_st.ds_evictions++;
+	}
+	de = ufs_slab_alloc(&dcache_slab);
+	if (de == NULL) {
+		return;
+	}
+	de->de_ufs = ufs;
+	de->de_dir = dir;
+	de->de_ino = ino;
+	de->de_hash = hash;
+	de->de_namlen = len;
+	memcpy(de->de_name, name, len);
+	de->de_next = dcache_head[hash & dcache_mask];
+	dcache_head[hash & dcache_mask] = de;
+	TAILQ_INSERT_HEAD(&dcache_lru, de, de_lru);
+	dcache_st.ds_entries++;
+}
+
+/*
+ * Forget whatever is cached under directory dir, all of it if dir is 0.
+ */
+void dcache_purge (uufsd_t *ufs, ino_t dir)
+{
+	struct dcache_entry *de, *next;
+
+	if (dcache_head == NULL) {
+		return;
+	}
+	for (de = TAILQ_FIRST(&dcache_lru); de != NULL; de = next) {
+		next = TAILQ_NEXT(de, de_lru);
+		if (de->de_ufs == ufs && (dir == 0 || de->de_dir == dir)) {
+			dcache_free(de);
+		}
+	}
+	if (dcache_st.ds_entries == 0) {
+		ufs_slab_destroy(&dcache_slab);
+	}
+}
+
+void dcache_stats (struct dcache_stats *ds)
+{
+	*ds = dcache_st;
+	ds->ds_limit = (size_t)dcache_max;
+}
@@ -0,0 +1,607 @@
+/**
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ufs
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Directory hashing, after the FreeBSD kernel's ufs_dirhash.c.
+ *
+ * A directory of DH_MINSIZE bytes or more gets a hash from each name to
+ * the offset of its entry the first time it is looked up, so that a
+ * lookup reads one DIRBLKSIZ block instead of scanning the directory.
+ * Alongside it is kept the largest free run of every block, so that a
+ * new name goes straight to a block with room, or straight to growing
+ * the directory when there is none.
+ * A Bloom filter of the names answers most lookups of names that are
+ * not there without reading the directory at all.
+ * The hash hangs off the in-core inode and lives as long as its vnode;
+ * ufs_addnamedir() and ufs_unlink() keep it up to date.  All hashes
+ * together are held to dirhash_maxmem bytes, recycled by score: every
+ * use bumps a hash towards the tail of the list and the head one goes
+ * first, once its score has run down.
+ */
+
+#include "fuse-ufs.h"
+#include <sys/param.h>
+
+#define DH_MINSIZE	(5 * DIRBLKSIZ)	/* smaller directories are scanned */
+
+#define WRAPINCR(val, limit)	(((val) + 1 == (limit)) ? 0 : ((val) + 1))
+#define WRAPDECR(val, limit)	(((val) == 0) ? ((limit) - 1) : ((val) - 1))
+#define BLKFREE2IDX(n)		((n) > DH_NFSTATS ? DH_NFSTATS : (n))
+
+static TAILQ_HEAD(, dirhash) ufsdirhash_list =
+	TAILQ_HEAD_INITIALIZER(ufsdirhash_list);
+static size_t dirhash_maxmem;
+static size_t dirhash_mem;
+static struct dirhash_stats dirhash_st;
+
+void ufsdirhash_init (size_t maxmem)
+{
+	dirhash_maxmem = maxmem;
+}
+
+static u_int32_t ufsdirhash_hash(const char *name, int namelen)
+{
+	u_int32_t h = 2166136261U;
+	int i;
+
+	/* FNV-1a, as fnv_32_buf() in the kernel */
+	for (i = 0; i < namelen; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Step between the filter bits of a name, derived from its hash with
+ * the murmur3 finaliser so that the two are independent enough for
+ * double hashing.
+ */
+static inline u_int32_t ufsdirhash_bloomstep(u_int32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h | 1;
+}
+
+static void ufsdirhash_bloomadd(struct dirhash *dh, u_int32_t h)
+{
+	u_int32_t step = ufsdirhash_bloomstep(h), bit;
+	int i;
+
+	for (i = 0; i < DH_BLOOMK; i++, h += step) {
+		bit = h & dh->dh_bloommask;
+		if (isclr(dh->dh_bloom, bit)) {
+			setbit(dh->dh_bloom, bit);
+			dh->dh_bloomset++;
+		}
+	}
+}
+
+/* Could a name with hash h be in the directory? */
+static int ufsdirhash_bloomtest(struct dirhash *dh, u_int32_t h)
+{
+	u_int32_t step = ufsdirhash_bloomstep(h);
+	int i;
+
+	for (i = 0; i < DH_BLOOMK; i++, h += step) {
+		if (isclr(dh->dh_bloom, h & dh->dh_bloommask)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void ufsdirhash_freearrays(struct dirhash *dh)
+{
+	int i;
+
+	for (i = 0; i < dh->dh_narrays; i++) {
+		free(dh->dh_hash[i]);
+	}
+	free(dh->dh_hash);
+	dh->dh_hash = NULL;
+	free(dh->dh_blkfree);
+	dh->dh_blkfree = NULL;
+	free(dh->dh_bloom);
+	dh->dh_bloom = NULL;
+	dirhash_mem -= dh->dh_memreqd;
+	dh->dh_memreqd = 0;
+	dirhash_st.dhs_hashes--;
+}
+
+void ufsdirhash_free (struct inode *ip)
+{
+	struct dirhash *dh = ip->i_dirhash;
+
+	if (dh == NULL) {
+		return;
+	}
+	if (dh->dh_onlist) {
+		TAILQ_REMOVE(&ufsdirhash_list, dh, dh_list);
+	}
+	if (dh->dh_hash != NULL) {
+		ufsdirhash_freearrays(dh);
+	}
+	free(dh);
+	ip->i_dirhash = NULL;
+}
+
+/*
+ * Make room for bytes more of hashes by recycling the ones at the head
+ * of the list.  A hash that is still scored only loses a point, and the
+ * caller goes without: that bounds the builds when the working set of
+ * large directories does not fit.
+ */
+static int ufsdirhash_recycle(size_t bytes)
+{
+	struct dirhash *dh;
+
+	while (dirhash_mem + bytes > dirhash_maxmem) {
+		dh = TAILQ_FIRST(&ufsdirhash_list);
+		if (dh == NULL) {
+			return -1;
+		}
+		if (--dh->dh_score > 0) {
+			return -1;
+		}
+		/* The inode keeps the bare struct until it looks again */
+		TAILQ_REMOVE(&ufsdirhash_list, dh, dh_list);
+		dh->dh_onlist = 0;
+		ufsdirhash_freearrays(dh);
+		dirhash_st.dhs_recycles++;
+	}
+	return 0;
+}
+
+/* Count a use of dh and let it filter towards the tail of the list */
+static void ufsdirhash_touch(struct dirhash *dh)
+{
+	struct dirhash *next;
+
+	if (dh->dh_score < DH_SCOREMAX) {
+		dh->dh_score++;
+	}
+	next = TAILQ_NEXT(dh, dh_list);
+	if (next != NULL && next->dh_score <= dh->dh_score) {
+		TAILQ_REMOVE(&ufsdirhash_list, dh, dh_list);
+		TAILQ_INSERT_AFTER(&ufsdirhash_list, next, dh, dh_list);
+	}
+}
+
+static void ufsdirhash_insert(struct dirhash *dh, const char *name,
+	int namelen, doff_t offset)
+{
+	u_int32_t h;
+	int slot;
+
+	h = ufsdirhash_hash(name, namelen);
+	ufsdirhash_bloomadd(dh, h);
+	dh->dh_nnames++;
+	slot = h % dh->dh_hlen;
+	while (DH_ENTRY(dh, slot) >= 0) {
+		slot = WRAPINCR(slot, dh->dh_hlen);
+	}
+	if (DH_ENTRY(dh, slot) == DIRHASH_DEL) {
+		dh->dh_hused--;
+	}
+	DH_ENTRY(dh, slot) = offset;
+	dh->dh_hused++;
+}
+
+/*
+ * Room a new entry could take out of ep, in bytes: all of it when it
+ * is unused, what its name leaves over otherwise.
+ */
+static inline int ufsdirhash_slack(struct direct *ep)
+{
+	if (ep->d_ino == 0)
+		return ep->d_reclen;
+	return ep->d_reclen - DIRECTSIZ(ep->d_namlen & 0xFF);
+}
+
+/*
+ * Largest free run in the DIRBLKSIZ block at buf, in DIRALIGN words.
+ */
+int ufsdirhash_blkfree (const char *buf)
+{
+	struct direct *ep;
+	int off, slack, run = 0;
+
+	for (off = 0; off < DIRBLKSIZ; off += ep->d_reclen) {
+		ep = (struct direct *)(buf + off);
+		if (ep->d_reclen == 0) {
+			break;
+		}
+		slack = ufsdirhash_slack(ep);
+		if (slack > run) {
+			run = slack;
+		}
+	}
+	return run / DIRALIGN;
+}
+
+/*
+ * Hash every live entry of the directory and note the free space of
+ * each block.  Returns -1 if a block cannot be read or does not look
+ * like a directory block.
+ */
+static int ufsdirhash_fill(struct inode *ip, struct dirhash *dh)
+{
+	struct ufs_vnode *vnode = inode2vnode(ip);
+	uufsd_t *ufs = vnode->ufsp;
+	struct fs *fs = &ufs->d_fs;
+	struct direct *ep;
+	ufs2_daddr_t lbn, blkno;
+	char *buf = NULL;
+	doff_t pos, off;
+	int size, slack, ret = -1;
+	u_int8_t *freep;
+
+	if (ufs_get_blkbuf(ufs, fs->fs_bsize, &buf)) {
+		return -1;
+	}
+	for (lbn = 0; (pos = lblktosize(fs, lbn)) < (doff_t)ip->i_size; lbn++) {
+		if (ufs_bmap(ufs, vnode, lbn, &blkno) || blkno == 0) {
+			goto out;
+		}
+		size = ufs_inode_io_size(ip, pos, 0);
+		if (blkread(ufs, fsbtodb(fs, blkno), buf, size) == -1) {
+			goto out;
+		}
+		for (off = 0; off < size && pos + off < (doff_t)ip->i_size;
+		     off += ep->d_reclen) {
+			ep = (struct direct *)(buf + off);
+			slack = ufsdirhash_slack(ep);
+			if (ep->d_reclen == 0 || (ep->d_reclen & (DIRALIGN - 1)) ||
+			    ep->d_reclen > DIRBLKSIZ - (off & (DIRBLKSIZ - 1)) ||
+			    slack < 0) {
+				debugf("bad directory entry at %d in %d",
+				       pos + off, ip->i_number);
+				goto out;
+			}
+			freep = &dh->dh_blkfree[(pos + off) / DIRBLKSIZ];
+			if (slack / DIRALIGN > *freep) {
+				*freep = slack / DIRALIGN;
+			}
+			if (ep->d_ino != 0) {
+				ufsdirhash_insert(dh, ep->d_name,
+				    ep->d_namlen & 0xFF, pos + off);
+			}
+		}
+	}
+	for (size = 0; size <= DH_NFSTATS; size++) {
+		dh->dh_firstfree[size] = -1;
+	}
+	for (size = dh->dh_dirblks - 1; size >= 0; size--) {
+		dh->dh_firstfree[BLKFREE2IDX(dh->dh_blkfree[size])] = size;
+	}
+	ret = 0;
+out:
+	ufs_free_blkbuf(ufs, fs->fs_bsize, &buf);
+	return ret;
+}
+
+/*
+ * Make sure directory ip is hashed, if it is worth it.  Returns 0 when
+ * the hash can be used, -1 when the directory has to be scanned.
+ */
+int ufsdirhash_build (struct inode *ip)
+{
+	struct dirhash *dh;
+	size_t memreqd;
+	u_int32_t nbits;
+	int i, nslots, narrays, nblk;
+
+	if (dirhash_maxmem == 0 || (ip->i_mode & IFMT) != IFDIR ||
+	    ip->i_size < DH_MINSIZE) {
+		ufsdirhash_free(ip);
+		return -1;
+	}
+	dh = ip->i_dirhash;
+	if (dh != NULL) {
+		if (dh->dh_hash != NULL &&
+		    dh->dh_dirblks == (int)(ip->i_size / DIRBLKSIZ)) {
+			ufsdirhash_touch(dh);
+			return 0;
+		}
+		/* Recycled, or the directory changed behind its back */
+		ufsdirhash_free(ip);
+	}
+
+	/* Room for the directory packed with one-character names, and then some */
+	nslots = ip->i_size / DIRECTSIZ(1);
+	nslots = (nslots * 3 + 1) / 2;
+	narrays = howmany(nslots, DH_NBLKOFF);
+	nslots = narrays * DH_NBLKOFF;
+	/* Let the directory double before the hash has to be rebuilt */
+	nblk = (ip->i_size / DIRBLKSIZ) * 2;
+	for (nbits = NBBY; nbits < (1U << 31) &&
+	     nbits < (u_int64_t)nslots * DH_BLOOMBITS; nbits <<= 1)
+		;
+	memreqd = sizeof(*dh) + narrays * sizeof(*dh->dh_hash) +
+	    (size_t)nslots * sizeof(**dh->dh_hash) + nblk + nbits / NBBY;
+	if (memreqd > dirhash_maxmem / 2 || ufsdirhash_recycle(memreqd)) {
+		return -1;
+	}
+
+	dh = calloc(1, sizeof(*dh));
+	if (dh == NULL) {
+		return -1;
+	}
+	dh->dh_hash = calloc(narrays, sizeof(*dh->dh_hash));
+	if (dh->dh_hash == NULL) {
+		free(dh);
+		return -1;
+	}
+	dh->dh_narrays = narrays;
+	dh->dh_blkfree = calloc(nblk, sizeof(*dh->dh_blkfree));
+	dh->dh_nblk = nblk;
+	dh->dh_bloom = calloc(nbits / NBBY, 1);
+	dh->dh_bloommask = nbits - 1;
+	dh->dh_memreqd = memreqd;
+	dirhash_mem += memreqd;
+	dirhash_st.dhs_hashes++;
+	if (dh->dh_blkfree == NULL || dh->dh_bloom == NULL) {
+		goto fail;
+	}
+	for (i = 0; i < narrays; i++) {
+		dh->dh_hash[i] = malloc(DH_NBLKOFF * sizeof(**dh->dh_hash));
+		if (dh->dh_hash[i] == NULL) {
+			goto fail;
+		}
+		/* Every byte 0xff is DIRHASH_EMPTY */
+		memset(dh->dh_hash[i], 0xff, DH_NBLKOFF * sizeof(**dh->dh_hash));
+	}
+	dh->dh_hlen = nslots;
+	dh->dh_dirblks = ip->i_size / DIRBLKSIZ;
+	if (ufsdirhash_fill(ip, dh)) {
+		goto fail;
+	}
+
+	dh->dh_score = DH_SCOREINIT;
+	TAILQ_INSERT_TAIL(&ufsdirhash_list, dh, dh_list);
+	dh->dh_onlist = 1;
+	ip->i_dirhash = dh;
+	dirhash_st.dhs_builds++;
+	return 0;
+fail:
+	ip->i_dirhash = dh;
+	ufsdirhash_free(ip);
+	return -1;
+}
+
+/*
+ * Find name in hashed directory ip.  Only the DIRBLKSIZ blocks holding
+ * candidate entries are read.
+ */
+int ufsdirhash_lookup (struct inode *ip, const char *name, int namelen,
+	doff_t *offp, ino_t *inop)
+{
+	struct dirhash *dh = ip->i_dirhash;
+	struct ufs_vnode *vnode = inode2vnode(ip);
+	uufsd_t *ufs = vnode->ufsp;
+	struct fs *fs = &ufs->d_fs;
+	struct direct *dp;
+	ufs2_daddr_t blkno;
+	char buf[DIRBLKSIZ];
+	doff_t off, chunk = -1;
+	u_int32_t h;
+	int slot, i;
+
+	if (dh == NULL || dh->dh_hash == NULL) {
+		return -1;
+	}
+	ufsdirhash_touch(dh);
+
+	h = ufsdirhash_hash(name, namelen);
+	if (!ufsdirhash_bloomtest(dh, h)) {
+		dirhash_st.dhs_bloomneg++;
+		dirhash_st.dhs_misses++;
+		return ENOENT;
+	}
+	slot = h % dh->dh_hlen;
+	for (i = 0; i < dh->dh_hlen; i++, slot = WRAPINCR(slot, dh->dh_hlen)) {
+		off = DH_ENTRY(dh, slot);
+		if (off == DIRHASH_EMPTY) {
+			break;
+		}
+		if (off == DIRHASH_DEL) {
+			continue;
+		}
+		if (off < 0 || off >= dh->dh_dirblks * DIRBLKSIZ) {
+			ufsdirhash_free(ip);
+			return -1;
+		}
+		if (chunk != (off & ~(DIRBLKSIZ - 1))) {
+			chunk = off & ~(DIRBLKSIZ - 1);
+			if (ufs_bmap(ufs, vnode, lblkno(fs, chunk), &blkno) ||
+			    blkno == 0 || blkread(ufs, fsbtodb(fs, blkno) +
+			    blkoff(fs, chunk) / DEV_BSIZE, buf, DIRBLKSIZ) == -1) {
+				return -1;
+			}
+		}
+		dp = (struct direct *)(buf + (off - chunk));
+		if (dp->d_ino != 0 && (dp->d_namlen & 0xFF) == namelen &&
+		    memcmp(dp->d_name, name, namelen) == 0) {
+			*offp = off;
+			*inop = dp->d_ino;
+			dirhash_st.dhs_hits++;
+			return 0;
+		}
+	}
+	dirhash_st.dhs_misses++;
+	return ENOENT;
+}
+
+/*
+ * The directory grew by the DIRBLKSIZ block at offset.
+ */
+void ufsdirhash_newblk (struct inode *ip, doff_t offset)
+{
+	struct dirhash *dh = ip->i_dirhash;
+
+	if (dh == NULL || dh->dh_hash == NULL) {
+		return;
+	}
+	if (offset != dh->dh_dirblks * DIRBLKSIZ ||
+	    dh->dh_dirblks >= dh->dh_nblk) {
+		ufsdirhash_free(ip);
+		return;
+	}
+	dh->dh_blkfree[dh->dh_dirblks] = DIRBLKSIZ / DIRALIGN;
+	if (dh->dh_firstfree[DH_NFSTATS] == -1) {
+		dh->dh_firstfree[DH_NFSTATS] = dh->dh_dirblks;
+	}
+	dh->dh_dirblks++;
+}
+
+/*
+ * Find a block with a free run of slotneeded bytes.  Returns its offset,
+ * or -1 if the directory has to grow (or is not hashed).
+ */
+doff_t ufsdirhash_findfree (struct inode *ip, int slotneeded)
+{
+	struct dirhash *dh = ip->i_dirhash;
+	int i;
+
+	if (dh == NULL || dh->dh_hash == NULL) {
+		return -1;
+	}
+	for (i = howmany(slotneeded, DIRALIGN); i <= DH_NFSTATS; i++) {
+		if (dh->dh_firstfree[i] != -1) {
+			return dh->dh_firstfree[i] * DIRBLKSIZ;
+		}
+	}
+	return -1;
+}
+
+/*
+ * The block at offset now has a free run of nfree DIRALIGN words.
+ */
+void ufsdirhash_setfree (struct inode *ip, doff_t offset, int nfree)
+{
+	struct dirhash *dh = ip->i_dirhash;
+	int block, i, ofidx, nfidx;
+
+	if (dh == NULL || dh->dh_hash == NULL) {
+		return;
+	}
+	block = offset / DIRBLKSIZ;
+	if (block >= dh->dh_dirblks) {
+		ufsdirhash_free(ip);
+		return;
+	}
+	ofidx = BLKFREE2IDX(dh->dh_blkfree[block]);
+	nfidx = BLKFREE2IDX(nfree);
+	dh->dh_blkfree[block] = nfree;
+	if (ofidx == nfidx) {
+		return;
+	}
+	/* If this was the first block in its list, find the next one */
+	if (dh->dh_firstfree[ofidx] == block) {
+		for (i = block + 1; i < dh->dh_dirblks; i++) {
+			if (BLKFREE2IDX(dh->dh_blkfree[i]) == ofidx) {
+				break;
+			}
+		}
+		dh->dh_firstfree[ofidx] = (i < dh->dh_dirblks) ? i : -1;
+	}
+	if (dh->dh_firstfree[nfidx] > block || dh->dh_firstfree[nfidx] == -1) {
+		dh->dh_firstfree[nfidx] = block;
+	}
+}
+
+/*
+ * An entry for name was created at offset.
+ */
+void ufsdirhash_add (struct inode *ip, const char *name, int namelen,
+	doff_t offset)
+{
+	struct dirhash *dh = ip->i_dirhash;
+
+	if (dh == NULL || dh->dh_hash == NULL) {
+		return;
+	}
+	/* Too full to keep probing cheap: build a bigger one next time */
+	if (dh->dh_hused >= (dh->dh_hlen * 3) / 4) {
+		ufsdirhash_free(ip);
+		return;
+	}
+	ufsdirhash_insert(dh, name, namelen, offset);
+}
+
+/*
+ * The entry for name at offset was removed.
+ */
+void ufsdirhash_remove (struct inode *ip, const char *name, int namelen,
+	doff_t offset)
+{
+	struct dirhash *dh = ip->i_dirhash;
+	int slot, i;
+
+	if (dh == NULL || dh->dh_hash == NULL) {
+		return;
+	}
+	slot = ufsdirhash_hash(name, namelen) % dh->dh_hlen;
+	for (i = 0; DH_ENTRY(dh, slot) != offset; i++) {
+		if (DH_ENTRY(dh, slot) == DIRHASH_EMPTY || i == dh->dh_hlen) {
+			/* Not where it should be: stop trusting the hash */
+			ufsdirhash_free(ip);
+			return;
+		}
+		slot = WRAPINCR(slot, dh->dh_hlen);
+	}
+
+	/*
+	 * A chain runs until an empty slot, so a deleted slot has to stay
+	 * marked unless it ends the chain, and then so do the deleted
+	 * slots just before it.
+	 */
+	DH_ENTRY(dh, slot) = DIRHASH_DEL;
+	if (DH_ENTRY(dh, WRAPINCR(slot, dh->dh_hlen)) == DIRHASH_EMPTY) {
+		while (DH_ENTRY(dh, slot) == DIRHASH_DEL) {
+			DH_ENTRY(dh, slot) = DIRHASH_EMPTY;
+			dh->dh_hused--;
+			slot = WRAPDECR(slot, dh->dh_hlen);
+		}
+	}
+
+	/*
+	 * The name stays in the filter.  When such names are a good part
+	 * of a filter that is filling up, as after a burst of renames,
+	 * start over: the next lookup builds a fresh hash and filter.
+	 */
+	dh->dh_nnames--;
+	dh->dh_bloomstale++;
+	if (dh->dh_bloomstale > dh->dh_nnames / 2 &&
+	    dh->dh_bloomset > (dh->dh_bloommask + 1) / 8 * 3) {
+		dirhash_st.dhs_bloomrebuilds++;
+		ufsdirhash_free(ip);
+	}
+}
+
+void ufsdirhash_stats (struct dirhash_stats *dhs)
+{
+	*dhs = dirhash_st;
+	dhs->dhs_mem = dirhash_mem;
+	dhs->dhs_maxmem = dirhash_maxmem;
+}
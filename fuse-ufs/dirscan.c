@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ufs
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Name search in directory blocks.
+ *
+ * A lookup walks the entries of a block by d_reclen and compares 16
+ * bytes of each entry at once against a key made up front: d_namlen
+ * and the first 15 bytes of the name, with a mask covering only the
+ * bytes that name has.  Only an entry that passes is compared in full,
+ * and only past those 15 bytes.  With SSE2 the 16 bytes are a single
+ * vector compare, elsewhere two 64-bit words.
+ */
+
+#include "fuse-ufs.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DK_OFF	offsetof(struct direct, d_namlen)	/* start of the key */
+#define DK_SIZE	16
+
+void ufs_dirkey_init (struct ufs_dirkey *key, const char *name, int len)
+{
+	unsigned char *head = (unsigned char *)key->dk_head;
+	unsigned char *mask = (unsigned char *)key->dk_mask;
+	int n = MIN(len + 1, DK_SIZE);
+
+	memset(key->dk_head, 0, sizeof(key->dk_head));
+	memset(key->dk_mask, 0, sizeof(key->dk_mask));
+	head[0] = len;
+	memcpy(head + 1, name, n - 1);
+	memset(mask, 0xff, n);
+	key->dk_bits = (1 << n) - 1;
+	key->dk_name = name;
+	key->dk_len = len;
+}
+
+/*
+ * Does the entry at dp, which has at least DK_SIZE bytes from DK_OFF
+ * in the buffer, have the key's length and first bytes?
+ */
+static inline int dirkey_prefilter (const struct ufs_dirkey *key,
+	const char *dp)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i *)(dp + DK_OFF));
+	__m128i k = _mm_load_si128((const __m128i *)key->dk_head);
+
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(v, k)) & key->dk_bits) ==
+		key->dk_bits;
+#else
+	u_int64_t v[2];
+
+	memcpy(v, dp + DK_OFF, sizeof(v));
+	return ((v[0] ^ key->dk_head[0]) & key->dk_mask[0]) == 0 &&
+		((v[1] ^ key->dk_head[1]) & key->dk_mask[1]) == 0;
+#endif
+}
+
+/*
+ * Look for the key in the size bytes of directory entries at buf,
+ * which begin a DIRBLKSIZ block.  Returns the offset in buf of the
+ * live entry with that name, setting *ino, or -1 if there is none.
+ * A d_reclen that leaves the buffer ends the search.
+ */
+int ufs_dirblk_find (const char *buf, int size, const struct ufs_dirkey *key,
+	ino_t *ino)
+{
+	const struct direct *dp;
+	int off, reclen, done;
+
+	for (off = 0; off < size; off += reclen) {
+		dp = (const struct direct *)(buf + off);
+		reclen = dp->d_reclen;
+		if (reclen == 0 || reclen > size - off) {
+			break;
+		}
+		if (off + DK_OFF + DK_SIZE <= size) {
+			if (!dirkey_prefilter(key, (const char *)dp)) {
+				continue;
+			}
+			done = MIN(key->dk_len, DK_SIZE - 1);
+		} else {
+			/* Too near the end of the buffer to load the key */
+			if ((dp->d_namlen & 0xFF) != key->dk_len) {
+				continue;
+			}
+			done = 0;
+		}
+		if (dp->d_ino == 0 || DIRECTSIZ(key->dk_len) > reclen) {
+			continue;
+		}
+		if (memcmp(dp->d_name + done, key->dk_name + done,
+			   key->dk_len - done) != 0) {
+			continue;
+		}
+		*ino = dp->d_ino;
+		return off;
+	}
+	return -1;
+}
@@ -56,6 +56,10 @@ int do_killfilebyinode (uufsd_t *ufs, ino_t ino, struct ufs_vnode *vnode)
 		debugf("Unable to free inode\n");
 		return -EIO;
 	}
+	/* The inode number may come back as a new directory */
+	if (S_ISDIR(inode->i_mode)) {
+		dcache_purge(ufs, ino);
+	}
 
 	ufs_clear_inode(vnode);
 	rc = ufs_write_inode(ufs, ino, vnode);
@@ -39,7 +39,7 @@ ufs_inode_alloc(struct inode *ip, int cg,
 	if (fs->fs_cs(fs, cg).cs_nifree == 0)
 		return (0);
 
-	error = ufs_get_mem(fs->fs_cgsize, &buf);
+	error = ufs_get_blkbuf(ufs, fs->fs_cgsize, &buf);
 	if (error) {
 		return -ENOMEM;
 	}
@@ -109,7 +109,7 @@ gotit:
 	if (fs->fs_magic == FS_UFS2_MAGIC &&
 	    ipref + INOPB(fs) > cgp->cg_initediblk &&
 	    cgp->cg_initediblk < cgp->cg_niblk) {
-		error = ufs_get_mem(fs->fs_bsize, &ibp);
+		error = ufs_get_blkbuf(ufs, fs->fs_bsize, &ibp);
 		if (error) {
 			ret = -ENOMEM;
 			goto out;
@@ -157,8 +157,8 @@ gotit:
 	ret = (cg * fs->fs_ipg + ipref);
 out:
 	if (buf) {
-		ufs_free_mem(&buf);
-		ufs_free_mem(&ibp);
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
+		ufs_free_blkbuf(ufs, fs->fs_bsize, &ibp);
 	}
 	return ret;
 }
@@ -336,7 +336,8 @@ ufs_alloccg(struct inode *ip, int cg, ufs2_daddr_t bpref, int size)
 	if (fs->fs_cs(fs, cg).cs_nbfree == 0 && size == fs->fs_bsize)
 		return (0);
 
-	blockbuf = malloc(fs->fs_cgsize);
+	if (ufs_get_blkbuf((uufsd_t *)ip->i_dev, fs->fs_cgsize, &blockbuf))
+		return (0);
 
 	error = blkread((uufsd_t *)ip->i_dev, fsbtodb(fs, cgtod(fs, cg)), blockbuf, (int)fs->fs_cgsize);
 
@@ -353,6 +354,7 @@ ufs_alloccg(struct inode *ip, int cg, ufs2_daddr_t bpref, int size)
 		blkno = ufs_alloccgblk(ip, blockbuf, bpref);
 		ACTIVECLEAR(fs, cg);
 		blkwrite((uufsd_t *)ip->i_dev, fsbtodb(fs, cgtod(fs, cg)), blockbuf, fs->fs_cgsize);
+		ufs_free_blkbuf((uufsd_t *)ip->i_dev, fs->fs_cgsize, &blockbuf);
 		return (blkno);
 	}
 	/*
@@ -384,6 +386,7 @@ ufs_alloccg(struct inode *ip, int cg, ufs2_daddr_t bpref, int size)
 		cgp->cg_frsum[i]++;
 		ACTIVECLEAR(fs, cg);
 		blkwrite((uufsd_t *)ip->i_dev, fsbtodb(fs, cgtod(fs, cg)), blockbuf, fs->fs_cgsize);
+		ufs_free_blkbuf((uufsd_t *)ip->i_dev, fs->fs_cgsize, &blockbuf);
 		return (blkno);
 	}
 	bno = ffs_mapsearch(fs, cgp, bpref, allocsiz);
@@ -401,12 +404,11 @@ ufs_alloccg(struct inode *ip, int cg, ufs2_daddr_t bpref, int size)
 	blkno = cgbase(fs, cg) + bno;
 	ACTIVECLEAR(fs, cg);
 	blkwrite((uufsd_t *)ip->i_dev, fsbtodb(fs, cgtod(fs, cg)), blockbuf, fs->fs_cgsize);
+	ufs_free_blkbuf((uufsd_t *)ip->i_dev, fs->fs_cgsize, &blockbuf);
 	return (blkno);
 
 fail:
-	if (blockbuf) {
-		free(blockbuf);
-	}
+	ufs_free_blkbuf((uufsd_t *)ip->i_dev, fs->fs_cgsize, &blockbuf);
 	return (0);
 }
 
@@ -541,19 +543,19 @@ ufs_block_free(
 		return;
 	}
 
-	if (ufs_get_mem(fs->fs_cgsize, &buf)) {
+	if (ufs_get_blkbuf(ufs, fs->fs_cgsize, &buf)) {
 		debugferr("unable to allocate memory\n");
 		return;
 	}
 
 	if (blkread(ufs, cgblkno, buf, fs->fs_cgsize) == -1) {
-		free(buf);
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 		return;
 	}
 
 	cgp = (struct cg *)buf;
 	if (!cg_chkmagic(cgp)) {
-		free(buf);
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 		return;
 	}
 	cgp->cg_old_time = cgp->cg_time = time(NULL);
@@ -610,7 +612,8 @@ ufs_block_free(
 		}
 	}
 	fs->fs_fmod = 1;
-	(void)blkwrite(ufs, cgblkno, buf, ufs->d_fs.fs_bsize);
+	(void)blkwrite(ufs, cgblkno, buf, fs->fs_cgsize);
+	ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 }
 
 
@@ -834,28 +837,85 @@ ufs_truncate(uufsd_t *ufs, struct ufs_vnode *vnode, int newsize)
 	return retval;
 }
 
-int
-ufs_write_inode(uufsd_t *ufs, ino_t ino, struct ufs_vnode *vnode)
+static int
+do_write_inode(uufsd_t *ufs, ino_t ino, struct ufs_vnode *vnode, int force)
 {
 	struct ufs2_dinode *dinop = NULL;
 	int rc;
 
+	if (ino == vnode->ino) {
+		int dirty = vnode_dirty(vnode);
+
+		/* Nothing changed since the inode was read or last written */
+		if (dirty == 0) {
+			return 0;
+		}
+		/*
+		 * With lazytime, timestamp-only changes wait in memory until
+		 * the vnode goes away, fsync or unmount.
+		 */
+		if (!force && dirty == UFS_VNODE_TIMES && current_data()->lazytime) {
+			return 0;
+		}
+	}
+
 	rc = getino(ufs, (void **)&dinop, ino, NULL);
 	if (rc) {
 		return rc;
 	}
 
 	copy_incore_to_ondisk(vnode2inode(vnode), UFS_DINODE(vnode2inode(vnode)));
-	/* getino above sets the inode block */
+	/* dinop points into the cached inode block, putino writes it */
 	bcopy(UFS_DINODE(vnode2inode(vnode)), dinop, sizeof(*dinop));
-	rc = blkwrite(ufs, fsbtodb(&ufs->d_fs, ino_to_fsba(&ufs->d_fs, ino)),
-				ufs->d_inoblock, ufs->d_fs.fs_bsize);
-	if (rc <= 0) {
+	rc = putino(ufs, ino);
+	if (rc == -1) {
 		return -EIO;
 	}
+	if (ino == vnode->ino) {
+		vnode->cold->ondisk = *dinop;
+	}
 	return 0;
 }
 
+int
+ufs_write_inode(uufsd_t *ufs, ino_t ino, struct ufs_vnode *vnode)
+{
+	return do_write_inode(ufs, ino, vnode, 0);
+}
+
+/*
+ * Write the inode out whatever changed in it, including timestamps
+ * that lazytime would hold back.
+ */
+int
+ufs_sync_inode(uufsd_t *ufs, struct ufs_vnode *vnode)
+{
+	return do_write_inode(ufs, vnode->ino, vnode, 1);
+}
+
+/*
+ * A read of vnode happened: update its access time in memory as the
+ * atime mount option says.  It reaches the disk with the next write
+ * of the inode.
+ */
+void
+ufs_touch_atime(uufsd_t *ufs, struct ufs_vnode *vnode)
+{
+	struct inode *inode = vnode2inode(vnode);
+	int mode = current_data()->atime;
+	time_t now;
+
+	if (mode == UFS_ATIME_NONE || ufs->d_fs.fs_ronly) {
+		return;
+	}
+	now = ufs->now ? ufs->now : time(NULL);
+	if (mode == UFS_ATIME_RELATIVE && inode->i_atime > inode->i_mtime &&
+	    inode->i_atime > inode->i_ctime && now - inode->i_atime < 24 * 60 * 60) {
+		return;
+	}
+	inode->i_atime = now;
+}
+
 struct link_struct  {
 	uufsd_t	*ufs;
 	const char	*name;
@@ -865,6 +925,7 @@ struct link_struct  {
 	int		done;
 	unsigned int	blocksize;
 	int		err;
+	int		blkfree;	/* free run left in the block used */
 };
 
 static int ufs_get_rec_len(uufsd_t *ufs,
@@ -949,6 +1010,7 @@ static int link_proc(struct direct *dirent,
 	dirent->d_type = IFTODT(ls->flags);
 	strncpy(dirent->d_name, ls->name, ls->namelen);
 	dirent->d_name[ls->namelen] = '\0';
+	ls->blkfree = ufsdirhash_blkfree(buf);
 	ls->done++;
 	return DIRENT_ABORT|DIRENT_CHANGED;
 }
@@ -956,8 +1018,11 @@ static int link_proc(struct direct *dirent,
 static int ufs_addnamedir(uufsd_t *ufs, ino_t dir, const char *name,
 		ino_t ino, int flags)
 {
-	int			retval;
+	int			retval = 0;
 	struct link_struct	ls;
+	struct ufs_vnode	*vnode;
+	struct inode		*ip;
+	doff_t			off, blk;
 
 	RETURN_IF_RDONLY(ufs);
 
@@ -970,24 +1035,61 @@ static int ufs_addnamedir(uufsd_t *ufs, ino_t dir, const char *name,
 	ls.blocksize = DIRBLKSIZ;
 	ls.err = 0;
 
-	retval = ufs_dir_iterate(ufs, dir, link_proc, &ls);
-	if (retval)
-		return retval;
-	if (ls.err)
-		return ls.err;
-
-	if (ls.done)
-		return 0; /* success */
+	vnode = vnode_get(ufs, dir);
+	if (vnode == NULL)
+		return -ENOMEM;
+	ip = vnode2inode(vnode);
 
-	/* Try to add another block to the directory
-	 * (A single DIRBLKSIZ block will be sufficient)
+	/*
+	 * A large directory is hashed now, so that the new name goes in
+	 * too, and its free space map sends us straight to a block with
+	 * room, or straight to growing the directory.
 	 */
-	if (ufs_dir_append(ufs, dir, ino, flags, name) != 0) {
-		debugf("Failed to expand directory");
-		return -ENOSPC;
+	if (ufsdirhash_build(ip) == 0) {
+		blk = ufsdirhash_findfree(ip, UFS_DIR_REC_LEN(ls.namelen));
+		if (blk != -1) {
+			retval = ufs_dir_scan(ufs, vnode, blk, blk + DIRBLKSIZ,
+					      link_proc, &ls, &off);
+			if (retval == 0 && !ls.err && !ls.done) {
+				debugf("free space map of %d is wrong", dir);
+				ufsdirhash_free(ip);
+				retval = ufs_dir_scan(ufs, vnode, 0, ip->i_size,
+						      link_proc, &ls, &off);
+			}
+		}
+	} else {
+		retval = ufs_dir_scan(ufs, vnode, 0, ip->i_size, link_proc,
+				      &ls, &off);
+	}
+	if (retval)
+		goto out;
+	if (ls.err) {
+		retval = ls.err;
+		goto out;
 	}
 
-	return 0; /* success */
+	if (!ls.done) {
+		/* Try to add another block to the directory
+		 * (A single DIRBLKSIZ block will be sufficient)
+		 */
+		off = ip->i_size;
+		if (ufs_dir_append(ufs, dir, ino, flags, name) != 0) {
+			debugf("Failed to expand directory");
+			retval = -ENOSPC;
+			goto out;
+		}
+		ufsdirhash_newblk(ip, off);
+		ls.blkfree = (DIRBLKSIZ - UFS_DIR_REC_LEN(ls.namelen)) / DIRALIGN;
+	}
+	ufsdirhash_setfree(ip, off, ls.blkfree);
+
+	if (name) {
+		ufsdirhash_add(ip, name, ls.namelen, off);
+		dcache_enter(ufs, dir, name, ls.namelen, ino);
+	}
+out:
+	vnode_put(vnode, 0);
+	return retval;
 }
 
 int
@@ -1027,6 +1129,7 @@ struct unlink_struct  {
 	int		flags;
 	struct direct *prev_dirent;
 	int		done;
+	int		blkfree;	/* free run left in the block changed */
 };
 
 static int unlink_proc(struct direct *dirent,
@@ -1037,12 +1140,13 @@ static int unlink_proc(struct direct *dirent,
 	struct unlink_struct *ls = (struct unlink_struct *) priv_data;
 	struct direct *prev;
 
-	if (dirent->d_ino==0) /* skip unused dentry */
-		return 0;
-
+	/* An entry past the start of a block is merged into the one before */
 	prev = ls->prev_dirent;
 	ls->prev_dirent = dirent;
 
+	if (dirent->d_ino==0) /* skip unused dentry */
+		return 0;
+
 	if (ls->name) {
 		if ((dirent->d_namlen & 0xFF) != ls->namelen)
 			return 0;
@@ -1062,6 +1166,7 @@ static int unlink_proc(struct direct *dirent,
 	else
 		dirent->d_ino = 0;
 	//bzero(dirent, dirent->d_reclen);
+	ls->blkfree = ufsdirhash_blkfree(buf);
 	ls->done++;
 	return DIRENT_ABORT|DIRENT_CHANGED;
 }
@@ -1070,6 +1175,10 @@ int
 ufs_unlink(uufsd_t *ufs, ino_t dir_ino, char *name, ino_t file_ino, int flags)
 {
 	struct unlink_struct ls;
+	struct ufs_vnode *vnode;
+	struct inode *ip;
+	doff_t start, end, off;
+	ino_t ino;
 	int retval = 0;
 
 	if (!name && !file_ino)
@@ -1084,11 +1193,40 @@ ufs_unlink(uufsd_t *ufs, ino_t dir_ino, char *name, ino_t file_ino, int flags)
 	ls.done = 0;
 	ls.prev_dirent = 0;
 
+	vnode = vnode_get(ufs, dir_ino);
+	if (vnode == NULL)
+		return -ENOMEM;
+	ip = vnode2inode(vnode);
+
+	/* In a hashed directory only the block holding the name is searched */
+	start = 0;
+	end = ip->i_size;
+	if (name && ufsdirhash_build(ip) == 0) {
+		switch (ufsdirhash_lookup(ip, name, ls.namelen, &off, &ino)) {
+		case 0:
+			start = off & ~(DIRBLKSIZ - 1);
+			end = start + DIRBLKSIZ;
+			break;
+		case ENOENT:
+			goto out;
+		}
+	}
 
-	retval = ufs_dir_iterate(ufs, dir_ino, unlink_proc, &ls);
+	retval = ufs_dir_scan(ufs, vnode, start, end, unlink_proc, &ls, &off);
 	if (retval)
-		return retval;
-	return 0;
+		goto out;
+	if (ls.done)
+		ufsdirhash_setfree(ip, off, ls.blkfree);
+	if (ls.done && name) {
+		ufsdirhash_remove(ip, name, ls.namelen, off);
+		dcache_enter(ufs, dir_ino, name, ls.namelen, 0);
+	} else if (ls.done) {
+		ufsdirhash_free(ip);
+		dcache_purge(ufs, dir_ino);
+	}
+out:
+	vnode_put(vnode, 0);
+	return retval;
 }
 
 int
@@ -1101,7 +1239,7 @@ ufs_free_inode(uufsd_t *ufs, struct ufs_vnode *vnode, ino_t ino, int mode)
 	struct fs *fs = &ufs->d_fs;
 	char *buf;
 
-	error = ufs_get_mem(fs->fs_cgsize, &buf);
+	error = ufs_get_blkbuf(ufs, fs->fs_cgsize, &buf);
 	if (error) {
 		return -ENOMEM;
 	}
@@ -1111,18 +1249,18 @@ ufs_free_inode(uufsd_t *ufs, struct ufs_vnode *vnode, ino_t ino, int mode)
 
 	if ((u_int)ino >= fs->fs_ipg * fs->fs_ncg) {
 		debugferr("Corrupted inode numbers in filesystem\n");
-		ufs_free_mem(&buf);
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 		exit(-1);
 	}
 
 	if ((error = blkread(ufs, cgbno, buf, (int)fs->fs_cgsize)) == -1) {
-		ufs_free_mem(&buf);
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 		return (error);
 	}
 
 	cgp = (struct cg *)buf;
 	if (!cg_chkmagic(cgp)) {
-		ufs_free_mem(&buf);
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 		return (0);
 	}
 
@@ -1148,9 +1286,10 @@ ufs_free_inode(uufsd_t *ufs, struct ufs_vnode *vnode, ino_t ino, int mode)
 	error = blkwrite(ufs, cgbno, buf, (int)fs->fs_cgsize);
 	if (error == -1) {
 		debugf("Unable to write the buffer\n");
+		ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 		return -EIO;
 	}
-	ufs_free_mem(&buf);
+	ufs_free_blkbuf(ufs, fs->fs_cgsize, &buf);
 	return (0);
 }
 
@@ -1167,7 +1306,8 @@ static void ufs_init_dir_block(uufsd_t *ufs, char *buf, u_int16_t block_size,
 	de->d_reclen = block_size;
 	de->d_type   = IFTODT(flags);
 	de->d_namlen = MIN(MAXNAMLEN, strlen(name));
-	strncpy(de->d_name, name, MAXNAMLEN+1);
+	/* The block was zeroed, so the name is terminated */
+	memcpy(de->d_name, name, de->d_namlen);
 }
 
 /* Append DIRBLKSIZ block to directory and fill in a single entry */
@@ -1181,10 +1321,8 @@ int ufs_dir_append(uufsd_t *ufs, ino_t d_ino,
 	char *dir_buf = NULL;
 
 	struct ufs_vnode *vnode = vnode_get(ufs, d_ino);
-	if (vnode == NULL) {
-		err = -ENOMEM;
-		goto out;
-	}
+	if (vnode == NULL)
+		return -ENOMEM;
 	struct inode *inode = vnode2inode(vnode);
 
 	/* Old and new directory size */
@@ -1210,8 +1348,7 @@ int ufs_dir_append(uufsd_t *ufs, ino_t d_ino,
 	/* Filesystem block number (lookup done later) */
 	ufs2_daddr_t fs_blkno = 0;
 
-	dir_buf = malloc(new_bytes);
-	if (!dir_buf) {
+	if (ufs_get_blkbuf(ufs, new_bytes, &dir_buf)) {
 		err = -ENOMEM;
 		goto out;
 	}
@@ -1272,10 +1409,10 @@ int ufs_dir_append(uufsd_t *ufs, ino_t d_ino,
 	inode->i_size = new_size;
 
 out:
-	free(dir_buf);
+	if (dir_buf)
+		ufs_free_blkbuf(ufs, new_bytes, &dir_buf);
 
-	if (vnode)
-		vnode_put(vnode, 1);
+	vnode_put(vnode, 1);
 
 	return err;
 }
@@ -22,6 +22,19 @@
 
 #define UFS_FILE_SHARED_INODE 0x8000
 
+/* Most blocks ufs_file_read()/ufs_file_write() hand to libufs in one batch */
+#define UFS_IO_BATCH 32
+
+/* Readahead window bounds, in blocks */
+#define UFS_RA_MIN 4
+#define UFS_RA_MAX 64
+
+/* Closed handles that keep their block buffer for the next open */
+#define UFS_FILE_KEEPBUF 64
+
+static struct ufs_slab file_slab;
+static int file_keptbufs;	/* closed handles still holding a buffer */
+
 int
 ufs_inode_io_size(struct inode *inode, int offset, int write)
 {
@@ -63,6 +76,7 @@ int ufs_file_open2(uufsd_t *fs, ino_t ino,
 			    int flags, ufs_file_t *ret)
 {
 	ufs_file_t 	file;
+	char		*buf;
 	int		retval;
 
 	/*
@@ -72,11 +86,20 @@ int ufs_file_open2(uufsd_t *fs, ino_t ino,
 	if ((flags & (UFS_FILE_WRITE | UFS_FILE_CREATE)) && (fs->d_fs.fs_ronly))
 		return EROFS;
 
-	retval = ufs_get_mem(sizeof(struct ufs_file), &file);
-	if (retval)
-		return retval;
-
+	if (file_slab.us_size == 0)
+		ufs_slab_init(&file_slab, sizeof(struct ufs_file));
+	file = ufs_slab_alloc(&file_slab);
+	if (!file)
+		return ENOMEM;
+
+	/* A recycled handle may still have a block buffer for this fs */
+	buf = file->buf;
+	if (buf)
+		file_keptbufs--;
+	if (buf && file->fs != fs)
+		ufs_free_blkbuf(file->fs, file->fs->d_fs.fs_bsize, &buf);
 	memset(file, 0, sizeof(struct ufs_file));
+	file->buf = buf;
 	file->magic = UFS_MAGIC_FILE;
 	file->fs = fs;
 	file->ino = ino;
@@ -101,17 +124,19 @@ int ufs_file_open2(uufsd_t *fs, ino_t ino,
 
 	retval = ufs_get_array(3, fs->d_fs.fs_bsize, &file->buf);
 	*/
-	retval = ufs_get_mem(fs->d_fs.fs_bsize, &file->buf);
-	if (retval)
-		goto fail_inode_alloc;
+	if (!file->buf) {
+		retval = ufs_get_blkbuf(fs, fs->d_fs.fs_bsize, &file->buf);
+		if (retval)
+			goto fail_inode_alloc;
+	}
 
 	*ret = file;
 	return 0;
 
 fail_inode_alloc:
 	if (file->buf)
-		ufs_free_mem(&file->buf);
-	ufs_free_mem(&file);
+		ufs_free_blkbuf(fs, fs->d_fs.fs_bsize, &file->buf);
+	ufs_slab_free(&file_slab, file);
 	return retval;
 }
 
@@ -512,22 +537,24 @@ int ufs_file_close2 (ufs_file_t file, void (*close_callback) (struct ufs_vnode *
 
 	retval = ufs_file_flush(file);
 
-	if (file->buf) {
-		ufs_free_mem(&file->buf);
+	if (file->buf && file_keptbufs >= UFS_FILE_KEEPBUF) {
+		ufs_free_blkbuf(file->fs, file->fs->d_fs.fs_bsize, &file->buf);
+	} else if (file->buf) {
+		file_keptbufs++;
 	}
 	if (!(file->flags & UFS_FILE_SHARED_INODE)) {
 		/*
-		 * Write inode to disk unless we're mounted read-only
-		 * (access time field should have changed at least?)
-		 * TODO: Track whether the inode is actually dirty
+		 * Write inode to disk only if something in it changed,
+		 * which never happens when we're mounted read-only.
 		 */
-		int dirty = !file->fs->d_fs.fs_ronly;
+		int dirty = !file->fs->d_fs.fs_ronly &&
+			vnode_dirty(file->inode) != 0;
 		vnode_put(file->inode, dirty);
 	} else if (close_callback != NULL) {
 		close_callback(file->inode, file->flags & UFS_FILE_MASK);
 	}
 
-	ufs_free_mem(&file);
+	ufs_slab_free(&file_slab, file);
 
 	return retval;
 }
@@ -537,6 +564,139 @@ int ufs_file_close(ufs_file_t file)
 	return ufs_file_close2(file, NULL);
 }
 
+/*
+ * Release the block buffers closed handles kept for fs, before it goes
+ * away.
+ */
+void ufs_file_cache_drain(uufsd_t *fs)
+{
+	void *obj;
+	ufs_file_t file;
+	int held = 0;
+
+	for (obj = file_slab.us_free; obj != NULL; obj = *(void **)obj) {
+		file = obj;
+		if (file->buf && file->fs == fs) {
+			ufs_free_blkbuf(fs, fs->d_fs.fs_bsize, &file->buf);
+			file_keptbufs--;
+		} else if (file->buf)
+			held = 1;
+	}
+	if (!held && file_slab.us_nfree == file_slab.us_total)
+		ufs_slab_destroy(&file_slab);
+}
+
+/*
+ * Read nblocks whole blocks, starting at the current (block aligned)
+ * position, straight into buf without going through file->buf.  The
+ * blocks are mapped first and then read as one batch, so the backend
+ * can have all of them in flight at once.
+ */
+static int ufs_file_read_blocks(ufs_file_t file, char *buf,
+				unsigned int nblocks)
+{
+	uufsd_t *fs = file->fs;
+	struct ufs_io io[UFS_IO_BATCH];
+	int bsize = fs->d_fs.fs_bsize;
+	ufs2_daddr_t pbn;
+	blk_t lbn;
+	unsigned int i, nio;
+	int retval;
+
+	/* file->buf may hold newer data for one of these blocks */
+	retval = ufs_file_flush(file);
+	if (retval)
+		return retval;
+
+	lbn = lblkno(&fs->d_fs, file->pos);
+	for (nio = 0, i = 0; i < nblocks; i++) {
+		retval = ufs_bmap(fs, file->inode, lbn + i, &pbn);
+		if (retval)
+			return retval;
+		if (!pbn) {
+			memset(buf + (size_t)i * bsize, 0, bsize);
+			continue;
+		}
+		io[nio].io_blkno = fsbtodb(&fs->d_fs, pbn);
+		io[nio].io_data = buf + (size_t)i * bsize;
+		io[nio].io_size = bsize;
+		nio++;
+	}
+	return bread_batch(fs, io, nio);
+}
+
+/*
+ * Sequential readahead.  A read that starts where the previous one
+ * ended grows the window, up to UFS_RA_MAX blocks or a quarter of the
+ * block cache; anything else collapses it.  Once the reader gets
+ * within half a window of what was already read ahead, the next
+ * window is mapped and handed to libufs as one batch.  Mapping it
+ * also pulls the indirect blocks ufs_bmap() will need into the block
+ * cache before the reader gets there.  Errors are ignored, the real
+ * read will report them.
+ */
+static void ufs_file_readahead(ufs_file_t file, unsigned int wanted)
+{
+	uufsd_t *fs = file->fs;
+	struct inode *inode = vnode2inode(file->inode);
+	struct ufs_io io[UFS_RA_MAX];
+	struct bcache_stats bs;
+	int bsize = fs->d_fs.fs_bsize;
+	unsigned int max, nio;
+	blk_t lbn, last, end, eof;
+	ufs2_daddr_t pbn;
+
+	if (file->pos != file->ra_next) {
+		file->ra_window = 0;
+		file->ra_end = 0;
+		file->ra_next = file->pos + wanted;
+		return;
+	}
+	file->ra_next = file->pos + wanted;
+	if (wanted == 0)
+		return;
+
+	last = lblkno(&fs->d_fs, file->pos + wanted - 1);
+	if (file->ra_window && file->ra_end > last + file->ra_window / 2)
+		return;
+
+	max = UFS_RA_MAX;
+	if (fs->d_cache != NULL) {
+		bcache_stats(fs, &bs);
+		if (max > bs.bs_limit / 4 / bsize)
+			max = bs.bs_limit / 4 / bsize;
+	}
+	if (max < UFS_RA_MIN)
+		return;
+	if (file->ra_window == 0)
+		file->ra_window = UFS_RA_MIN;
+	else if (file->ra_window * 2 <= max)
+		file->ra_window *= 2;
+	else
+		file->ra_window = max;
+
+	/* Only whole blocks, the tail is read at its own size */
+	eof = inode->i_size / bsize;
+	lbn = file->ra_end > last + 1 ? file->ra_end : last + 1;
+	end = last + 1 + file->ra_window;
+	if (end > eof)
+		end = eof;
+
+	for (nio = 0; lbn < end; lbn++) {
+		if (ufs_bmap(fs, file->inode, lbn, &pbn))
+			break;
+		if (!pbn)
+			continue;
+		io[nio].io_blkno = fsbtodb(&fs->d_fs, pbn);
+		io[nio].io_data = NULL;
+		io[nio].io_size = bsize;
+		nio++;
+	}
+	file->ra_end = lbn;
+	if (nio)
+		bprefetch_batch(fs, io, nio);
+}
+
 int ufs_file_read(ufs_file_t file, void *buf,
 			   unsigned int wanted, unsigned int *got)
 {
@@ -550,7 +710,28 @@ int ufs_file_read(ufs_file_t file, void *buf,
 
 	fs = file->fs;
 
+	ufs_file_readahead(file, wanted);
+
 	while ((file->pos < inode->i_size) && (wanted > 0)) {
+		unsigned int nblocks;
+
+		/* Whole blocks go straight to the caller, in batches */
+		left = inode->i_size - file->pos;
+		nblocks = (wanted < left ? wanted : left) / fs->d_fs.fs_bsize;
+		if (file->pos % fs->d_fs.fs_bsize == 0 && nblocks > 0) {
+			if (nblocks > UFS_IO_BATCH)
+				nblocks = UFS_IO_BATCH;
+			retval = ufs_file_read_blocks(file, ptr, nblocks);
+			if (retval)
+				goto fail;
+			c = nblocks * fs->d_fs.fs_bsize;
+			file->pos += c;
+			ptr += c;
+			count += c;
+			wanted -= c;
+			continue;
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -580,6 +761,58 @@ fail:
 }
 
 
+/*
+ * Write nblocks whole blocks, starting at the current (block aligned)
+ * position, straight from buf.  Only used past the direct blocks,
+ * where every block is a full one and never a fragment, so holes can
+ * simply be filled with newly allocated blocks.  Blocks that end up
+ * next to each other on disk go down as a single vectored write.
+ */
+static int ufs_file_write_blocks(ufs_file_t file, const char *buf,
+				 unsigned int nblocks)
+{
+	uufsd_t *fs = file->fs;
+	struct inode *inode = vnode2inode(file->inode);
+	struct ufs_io io[UFS_IO_BATCH];
+	int bsize = fs->d_fs.fs_bsize;
+	ufs2_daddr_t pbn;
+	blk_t lbn;
+	unsigned int i;
+	int retval, alloced = 0;
+
+	/* Get file->buf out of the way, it may hold one of these blocks */
+	retval = ufs_file_flush(file);
+	if (retval)
+		return retval;
+	lbn = lblkno(&fs->d_fs, file->pos);
+	if (file->blockno >= lbn && file->blockno < lbn + nblocks)
+		file->flags &= ~UFS_FILE_BUF_VALID;
+
+	for (i = 0; i < nblocks; i++) {
+		retval = ufs_bmap(fs, file->inode, lbn + i, &pbn);
+		if (retval)
+			return retval;
+		if (!pbn) {
+			retval = ufs_block_alloc(fs, inode, bsize, &pbn);
+			if (retval)
+				return retval;
+			retval = ufs_set_block(fs, inode, lbn + i, pbn);
+			if (retval)
+				return retval;
+			alloced = 1;
+		}
+		io[i].io_blkno = fsbtodb(&fs->d_fs, pbn);
+		io[i].io_data = (void *)(buf + (size_t)i * bsize);
+		io[i].io_size = bsize;
+	}
+	if (bwrite_batch(fs, io, nblocks) == -1)
+		return -EIO;
+
+	if (alloced && file->ino)
+		return ufs_write_inode(fs, file->ino, file->inode);
+	return 0;
+}
+
 int ufs_file_write(ufs_file_t file, const void *buf,
 			    unsigned int nbytes, unsigned int *written)
 {
@@ -594,6 +827,25 @@ int ufs_file_write(ufs_file_t file, const void *buf,
 		return EROFS;
 
 	while (nbytes > 0) {
+		unsigned int nblocks;
+
+		/* Whole indirect-mapped blocks bypass file->buf, in batches */
+		nblocks = nbytes / fs->d_fs.fs_bsize;
+		if (file->pos % fs->d_fs.fs_bsize == 0 && nblocks > 0 &&
+		    lblkno(&fs->d_fs, file->pos) >= NDADDR) {
+			if (nblocks > UFS_IO_BATCH)
+				nblocks = UFS_IO_BATCH;
+			retval = ufs_file_write_blocks(file, ptr, nblocks);
+			if (retval)
+				goto fail;
+			c = nblocks * fs->d_fs.fs_bsize;
+			file->pos += c;
+			ptr += c;
+			count += c;
+			nbytes -= c;
+			continue;
+		}
+
 		retval = sync_buffer_position(file);
 		if (retval)
 			goto fail;
@@ -67,6 +67,9 @@ struct ufs_file {
 	ufs2_daddr_t		physblock;
 	char 			*buf;
 	size_t lread; /* Size of valid data in buf */
+	__u64			ra_next;	/* where a sequential read would start */
+	blk_t			ra_end;		/* first block not read ahead yet */
+	unsigned int		ra_window;	/* readahead window in blocks */
 };
 
 typedef struct ufs_file *ufs_file_t;
@@ -149,4 +152,32 @@ _INLINE_ int ufs_resize_mem(unsigned long old_size,
 	memcpy(ptr, &p, sizeof(p));
 	return 0;
 }
+
+/*
+ *  Allocate a block I/O buffer from the aligned pool of the disk
+ */
+_INLINE_ int ufs_get_blkbuf(struct uufsd *disk, unsigned long size, void *ptr)
+{
+	void *pp;
+
+	pp = ufs_buf_alloc(disk, size);
+	if (!pp)
+		return ENOMEM;
+	memcpy(ptr, &pp, sizeof(pp));
+	return 0;
+}
+
+/*
+ * Return a block I/O buffer to the pool
+ */
+_INLINE_ int ufs_free_blkbuf(struct uufsd *disk, unsigned long size, void *ptr)
+{
+	void *p;
+
+	memcpy(&p, ptr, sizeof(p));
+	ufs_buf_free(disk, p, size);
+	p = 0;
+	memcpy(ptr, &p, sizeof(p));
+	return 0;
+}
 #endif
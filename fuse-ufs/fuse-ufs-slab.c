@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the fuse-ufs
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Fixed size object allocator for the structures fuse-ufs churns
+ * through on every lookup and open (vnodes, file handles).
+ *
+ * Objects are carved out of UFS_SLAB_CHUNK sized chunks, rounded up to
+ * a whole number of cache lines and aligned on one, so two objects
+ * never share a line.  Freed objects go on a free list threaded
+ * through their first word and are handed out again before any new
+ * chunk is allocated.  Chunks are only returned by ufs_slab_destroy().
+ */
+
+#include "fuse-ufs.h"
+#include <sys/param.h>
+
+void ufs_slab_init(struct ufs_slab *slab, size_t size)
+{
+	memset(slab, 0, sizeof(*slab));
+	slab->us_size = roundup(MAX(size, sizeof(void *)), UFS_CACHELINE);
+	slab->us_perchunk = (UFS_SLAB_CHUNK - UFS_CACHELINE) / slab->us_size;
+	if (slab->us_perchunk == 0) {
+		slab->us_perchunk = 1;
+	}
+}
+
+static int ufs_slab_grow(struct ufs_slab *slab)
+{
+	char *chunk, *obj;
+	size_t i;
+
+	/* The first cache line links the chunks together */
+	if (posix_memalign((void **)&chunk, UFS_CACHELINE,
+	    UFS_CACHELINE + slab->us_perchunk * slab->us_size) != 0) {
+		return -1;
+	}
+	*(void **)chunk = slab->us_chunks;
+	slab->us_chunks = chunk;
+	obj = chunk + UFS_CACHELINE;
+	memset(obj, 0, slab->us_perchunk * slab->us_size);
+	for (i = 0; i < slab->us_perchunk; i++, obj += slab->us_size) {
+		*(void **)obj = slab->us_free;
+		slab->us_free = obj;
+	}
+	slab->us_nfree += slab->us_perchunk;
+	slab->us_total += slab->us_perchunk;
+	return 0;
+}
+
+/*
+ * Returns an object that is not zeroed: it holds whatever its previous
+ * user left in it, except for the first word.
+ */
+void *ufs_slab_alloc(struct ufs_slab *slab)
+{
+	void *obj;
+
+	if (slab->us_free == NULL && ufs_slab_grow(slab) == -1) {
+		return NULL;
+	}
+	obj = slab->us_free;
+	slab->us_free = *(void **)obj;
+	slab->us_nfree--;
+	return obj;
+}
+
+void ufs_slab_free(struct ufs_slab *slab, void *obj)
+{
+	*(void **)obj = slab->us_free;
+	slab->us_free = obj;
+	slab->us_nfree++;
+}
+
+/*
+ * Give all chunks back.  Every object must have been freed.
+ */
+void ufs_slab_destroy(struct ufs_slab *slab)
+{
+	void *chunk;
+
+	while ((chunk = slab->us_chunks) != NULL) {
+		slab->us_chunks = *(void **)chunk;
+		free(chunk);
+	}
+	slab->us_free = NULL;
+	slab->us_nfree = slab->us_total = 0;
+}
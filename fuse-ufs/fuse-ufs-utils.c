@@ -22,74 +22,52 @@
 #define UFS_FILE_NOT_FOUND ENOENT
 #define DIRENT_ABORT 2
 
-struct lookup_struct  {
-	const char *name;
-	int	len;
-	ino_t	*inode;
-	int	found;
-};
-
-static int lookup_proc(struct direct *dirent, int inum, char *buf, void *priv_data)
-{
-	struct lookup_struct *ls = (struct lookup_struct *) priv_data;
-
-	if (dirent->d_ino==0) /* skip unused dentry */
-		return 0;
-
-	if (ls->len != (dirent->d_namlen & 0xFF))
-		return 0;
-	if (strncmp(ls->name, dirent->d_name, (dirent->d_namlen & 0xFF)))
-		return 0;
-	*ls->inode = dirent->d_ino;
-	ls->found++;
-	return DIRENT_ABORT;
-}
-
-int ufs_dir_iterate(uufsd_t *ufs, ino_t dirino,
-		    int (*func)(
+/*
+ * Call func for the entries of directory vnode from byte offset start,
+ * which must begin a DIRBLKSIZ block, up to end.  If where is not NULL,
+ * it is set to the offset of the entry func stopped the walk at, or -1.
+ */
+int ufs_dir_scan(uufsd_t *ufs, struct ufs_vnode *vnode, doff_t start, doff_t end,
+		 int (*func)(
 					  struct direct *dirent,
 					  int n,
 					  char *buf,
 					  void	*priv_data),
-			      void *priv_data)
+			      void *priv_data, doff_t *where)
 {
-	int i, ret = 0;
-	ufs2_daddr_t ndb;
+	int ret = 0;
+	ufs2_daddr_t lbn;
 	ufs2_daddr_t blkno;
-	int blksize = ufs->d_fs.fs_bsize;
-	u_int64_t dir_size;
+	int blksize;
+	doff_t pos;
 	char *dirbuf = NULL;
-	struct ufs_vnode *vnode;
+	struct fs *fs = &ufs->d_fs;
 
-	vnode = vnode_get(ufs, dirino);
-	if (vnode == NULL) {
-		ret = -ENOMEM;
-		goto out;
-	}
-	dir_size = vnode2inode(vnode)->i_size;
+	if (where)
+		*where = -1;
+	if (end > (doff_t)vnode2inode(vnode)->i_size)
+		end = vnode2inode(vnode)->i_size;
 
-	dirbuf = malloc(blksize);
-	if (!dirbuf) {
+	if (ufs_get_blkbuf(ufs, fs->fs_bsize, &dirbuf)) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
-	ndb = howmany(dir_size, ufs->d_fs.fs_bsize);
-	int offset, pos = 0;
-	for (i = 0; i < ndb ; i++) {
-		ret = ufs_bmap(ufs, vnode, i, &blkno);
+	int offset;
+	for (lbn = lblkno(fs, start); (pos = lblktosize(fs, lbn)) < end; lbn++) {
+		ret = ufs_bmap(ufs, vnode, lbn, &blkno);
 		if (ret) {
 			ret = -EIO;
 			goto out;
 		}
 		blksize = ufs_inode_io_size(vnode2inode(vnode), pos, 0);
-		if (blkread(ufs, fsbtodb(&ufs->d_fs, blkno), dirbuf, blksize) == -1) {
+		if (blkread(ufs, fsbtodb(fs, blkno), dirbuf, blksize) == -1) {
 			debugf("Unable to read block %d\n",blkno);
 			ret = -EIO;
 			goto out;
 		}
-		offset = 0;
-		while (offset < blksize && pos + offset < dir_size) {
+		offset = pos < start ? start - pos : 0;
+		while (offset < blksize && pos + offset < end) {
 			struct direct *de = (struct direct *)(dirbuf + offset);
 
 			/* HACK: Restrict frame for func() operations
@@ -100,28 +78,87 @@ int ufs_dir_iterate(uufsd_t *ufs, ino_t dirino,
 
 			ret = (*func)(de, blockoff, dirblock, priv_data);
 			if (ret & DIRENT_CHANGED) {
-				if (blkwrite(ufs, fsbtodb(&ufs->d_fs, blkno), dirbuf, blksize) == -1) {
+				if (blkwrite(ufs, fsbtodb(fs, blkno), dirbuf, blksize) == -1) {
 					debugf("Unable to write block %d\n",blkno);
 					ret = -EIO;
 					goto out;
 				}
 			}
 			if (ret & DIRENT_ABORT) {
+				if (where)
+					*where = pos + offset;
 				ret = 0;
 				goto out;
 			}
 			offset += de->d_reclen;
 		}
-		pos += blksize;
 	}
+	ret = 0;
 
 out:
-	if (vnode) {
-		vnode_put(vnode, 0);
-	}
-	if (dirbuf) {
-		free(dirbuf);
+	ufs_free_blkbuf(ufs, fs->fs_bsize, &dirbuf);
+	return ret;
+}
+
+int ufs_dir_iterate(uufsd_t *ufs, ino_t dirino,
+		    int (*func)(
+					  struct direct *dirent,
+					  int n,
+					  char *buf,
+					  void	*priv_data),
+			      void *priv_data)
+{
+	int ret;
+	struct ufs_vnode *vnode;
+
+	vnode = vnode_get(ufs, dirino);
+	if (vnode == NULL)
+		return -ENOMEM;
+	ret = ufs_dir_scan(ufs, vnode, 0, vnode2inode(vnode)->i_size,
+			   func, priv_data, NULL);
+	vnode_put(vnode, 0);
+	return ret;
+}
+
+/*
+ * Search the whole of directory vnode for key, a block at a time,
+ * without going through a per-entry callback.  Returns 0 with *ino set
+ * to 0 when the name is not there.
+ */
+static int ufs_dir_find(uufsd_t *ufs, struct ufs_vnode *vnode,
+			const struct ufs_dirkey *key, ino_t *ino)
+{
+	int ret = 0;
+	ufs2_daddr_t lbn;
+	ufs2_daddr_t blkno;
+	int blksize;
+	doff_t pos;
+	doff_t size = vnode2inode(vnode)->i_size;
+	char *dirbuf = NULL;
+	struct fs *fs = &ufs->d_fs;
+
+	*ino = 0;
+	if (ufs_get_blkbuf(ufs, fs->fs_bsize, &dirbuf))
+		return -ENOMEM;
+
+	for (lbn = 0; (pos = lblktosize(fs, lbn)) < size; lbn++) {
+		ret = ufs_bmap(ufs, vnode, lbn, &blkno);
+		if (ret) {
+			ret = -EIO;
+			break;
+		}
+		blksize = ufs_inode_io_size(vnode2inode(vnode), pos, 0);
+		if (blkread(ufs, fsbtodb(fs, blkno), dirbuf, blksize) == -1) {
+			debugf("Unable to read block %d\n",blkno);
+			ret = -EIO;
+			break;
+		}
+		if (ufs_dirblk_find(dirbuf, MIN(blksize, size - pos), key,
+				    ino) != -1)
+			break;
 	}
+
+	ufs_free_blkbuf(ufs, fs->fs_bsize, &dirbuf);
 	return ret;
 }
 
@@ -129,21 +166,38 @@ int ufs_lookup(uufsd_t *ufs, ino_t dir, const char *name, int namelen,
 		ino_t *ino)
 {
 	int	retval;
-	struct lookup_struct ls;
+	struct ufs_dirkey key;
+	struct ufs_vnode *vnode;
+	struct inode *ip;
+	doff_t off;
 
 	/* Initialize it to something sensible */
 	*ino = 0;
 
-	ls.name = name;
-	ls.len = namelen;
-	ls.inode = ino;
-	ls.found = 0;
+	if (dcache_lookup(ufs, dir, name, namelen, ino))
+		return (*ino) ? 0 : UFS_FILE_NOT_FOUND;
+
+	vnode = vnode_get(ufs, dir);
+	if (vnode == NULL)
+		return -ENOMEM;
+	ip = vnode2inode(vnode);
 
-	retval = ufs_dir_iterate(ufs, dir, lookup_proc, &ls);
+	/* Large directories are looked up through their hash */
+	retval = -1;
+	if (ufsdirhash_build(ip) == 0)
+		retval = ufsdirhash_lookup(ip, name, namelen, &off, ino);
+	if (retval == -1) {
+		ufs_dirkey_init(&key, name, namelen);
+		retval = ufs_dir_find(ufs, vnode, &key, ino);
+	} else if (retval == ENOENT) {
+		retval = 0;	/* the hash knows it is not there */
+	}
+	vnode_put(vnode, 0);
 	if (retval)
 		return retval;
 
-	return (ls.found) ? 0 : UFS_FILE_NOT_FOUND;
+	dcache_enter(ufs, dir, name, namelen, *ino);
+	return (*ino) ? 0 : UFS_FILE_NOT_FOUND;
 }
 
 static int
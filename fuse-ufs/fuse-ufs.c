@@ -19,6 +19,7 @@
 
 #include "fuse-ufs.h"
 #include <fcntl.h>
+#include <limits.h>
 
 static const char *HOME = "http://sourceforge.net/projects/fuse-ufs/";
 
@@ -36,7 +37,8 @@ static const char *usage_msg =
 "\n"
 "Usage:    %s <device|image_file> <mount_point> [-o option[,...]]\n"
 "\n"
-"Options:  ro, force, allow_others\n"
+"Options:  ro, force, allow_others, cache_size=MB,\n"
+"          inode_cache=N, inode_flush=SEC, backend=name[:args]\n"
 "          Please see details in the manual.\n"
 "\n"
 "Example:  fuse-ufs /dev/sda1 /mnt/sda1\n"
@@ -82,6 +84,28 @@ static void usage (void)
 	printf(usage_msg, PACKAGE, VERSION, fuse_version(), PACKAGE, HOME);
 }
 
+/*
+ * Parse the value of a numeric mount option: a plain decimal number no
+ * larger than max, without sign or trailing characters.
+ */
+static int parse_number (const char *opt, const char *val, unsigned long max,
+			 unsigned long *num)
+{
+	char *end;
+
+	if (!val || !*val) {
+		debugf_main("'%s' option requires a value", opt);
+		return -1;
+	}
+	errno = 0;
+	*num = strtoul(val, &end, 10);
+	if (*val < '0' || *val > '9' || *end != '\0' || errno || *num > max) {
+		debugf_main("'%s' option has an invalid value '%s'", opt, val);
+		return -1;
+	}
+	return 0;
+}
+
 static int parse_options (int argc, char *argv[], struct ufs_data *opts)
 {
 	int c;
@@ -168,6 +192,7 @@ static int parse_options (int argc, char *argv[], struct ufs_data *opts)
 static char * parse_mount_options (const char *orig_opts, struct ufs_data *opts, int *err)
 {
 	char *options, *s, *opt, *val, *ret;
+	unsigned long num;
 
 	ret = malloc(strlen(def_opts) + strlen(orig_opts) + 256 + PATH_MAX);
 	if (!ret) {
@@ -185,6 +210,13 @@ static char * parse_mount_options (const char *orig_opts, struct ufs_data *opts,
 
 	s = options;
 	opts->readonly = 1;
+	opts->cache_size = UFS_DEF_CACHE_SIZE;
+	opts->inode_cache = UFS_DEF_INODE_CACHE;
+	opts->inode_flush = UFS_DEF_INODE_FLUSH;
+	opts->vnode_cache = UFS_DEF_VNODE_CACHE;
+	opts->dentry_cache = UFS_DEF_DENTRY_CACHE;
+	opts->dirhash_mem = UFS_DEF_DIRHASH_MEM;
+	opts->atime = UFS_ATIME_NONE;
 
 	while (s && *s && (val = strsep(&s, ","))) {
 		opt = strsep(&val, "=");
@@ -223,6 +255,85 @@ static char * parse_mount_options (const char *orig_opts, struct ufs_data *opts,
 				goto err_exit;
 			}
 			opts->silent = 1;
+		} else if (!strcmp(opt, "direct_io")) { /* O_DIRECT device I/O */
+			if (val) {
+				debugf_main("'direct_io' option should not have value");
+				goto err_exit;
+			}
+			/* FUSE gets it too, so no layer caches file data twice */
+			opts->direct_io = 1;
+			strcat(ret, "direct_io,");
+		} else if (!strcmp(opt, "cache_size")) { /* block cache size in MB */
+			if (parse_number(opt, val, (size_t)-1 >> 20, &num)) {
+				goto err_exit;
+			}
+			opts->cache_size = (size_t)num << 20;
+		} else if (!strcmp(opt, "inode_cache")) { /* inode blocks cached */
+			if (parse_number(opt, val, INT_MAX, &num)) {
+				goto err_exit;
+			}
+			opts->inode_cache = (int)num;
+		} else if (!strcmp(opt, "inode_flush")) { /* inode write-back delay */
+			if (parse_number(opt, val, INT_MAX, &num)) {
+				goto err_exit;
+			}
+			opts->inode_flush = (int)num;
+		} else if (!strcmp(opt, "vnode_cache")) { /* unused inodes kept */
+			if (parse_number(opt, val, INT_MAX, &num)) {
+				goto err_exit;
+			}
+			opts->vnode_cache = (int)num;
+		} else if (!strcmp(opt, "dentry_cache")) { /* names cached */
+			if (parse_number(opt, val, INT_MAX, &num)) {
+				goto err_exit;
+			}
+			opts->dentry_cache = (int)num;
+		} else if (!strcmp(opt, "dirhash_mem")) { /* directory hashes in MB */
+			if (parse_number(opt, val, (size_t)-1 >> 20, &num)) {
+				goto err_exit;
+			}
+			opts->dirhash_mem = (size_t)num << 20;
+		} else if (!strcmp(opt, "noatime")) { /* reads leave atime alone */
+			if (val) {
+				debugf_main("'noatime' option should not have value");
+				goto err_exit;
+			}
+			opts->atime = UFS_ATIME_NONE;
+		} else if (!strcmp(opt, "relatime")) { /* atime at most daily */
+			if (val) {
+				debugf_main("'relatime' option should not have value");
+				goto err_exit;
+			}
+			opts->atime = UFS_ATIME_RELATIVE;
+		} else if (!strcmp(opt, "strictatime")) { /* atime on every read */
+			if (val) {
+				debugf_main("'strictatime' option should not have value");
+				goto err_exit;
+			}
+			opts->atime = UFS_ATIME_STRICT;
+		} else if (!strcmp(opt, "lazytime")) { /* defer timestamp writes */
+			if (val) {
+				debugf_main("'lazytime' option should not have value");
+				goto err_exit;
+			}
+			opts->lazytime = 1;
+		} else if (!strcmp(opt, "readdirplus")) { /* readdir reads inodes */
+			if (val) {
+				debugf_main("'readdirplus' option should not have value");
+				goto err_exit;
+			}
+			opts->readdirplus = 1;
+		} else if (!strcmp(opt, "backend")) { /* device I/O backend */
+			if (!val || !*val) {
+				debugf_main("'backend' option requires a value");
+				goto err_exit;
+			}
+			free(opts->backend);
+			opts->backend = strdup(val);
+			if (!opts->backend) {
+				*err = ENOMEM;
+				goto err_exit;
+			}
 		} else { /* Probably FUSE option. */
 			strcat(ret, opt);
 			if (val) {
@@ -384,6 +495,7 @@ err_out:
 	free(opts.options);
 	free(opts.device);
 	free(opts.volname);
+	free(opts.backend);
 	if (err) {
 		fprintf(stderr, "%s failed : %s\n", argv[0], strerror(err));
 	}
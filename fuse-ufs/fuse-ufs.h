@@ -46,6 +46,7 @@
 #include <libufs/dir.h>
 #include <libufs/extattr.h>
 #include <libufs/inode.h>
+#include <libufs/dirhash.h>
 #include <libufs/libufs.h>
 #include <ext2fs/ext2fs.h>
 
@@ -79,6 +80,18 @@
 
 #define MIN(X, Y) X < Y ? X : Y
 
+#define UFS_DEF_CACHE_SIZE (16 << 20)
+#define UFS_DEF_INODE_CACHE INOCACHE_DEFAULT
+#define UFS_DEF_INODE_FLUSH 5
+#define UFS_DEF_VNODE_CACHE 4096
+#define UFS_DEF_DENTRY_CACHE 8192
+#define UFS_DEF_DIRHASH_MEM (16 << 20)
+
+/* When reads update the access time */
+#define UFS_ATIME_NONE		0	/* noatime: never */
+#define UFS_ATIME_RELATIVE	1	/* relatime: once a day or after a change */
+#define UFS_ATIME_STRICT	2	/* strictatime: on every read */
+
 typedef struct uufsd uufsd_t;
 
 struct ufs_data {
@@ -86,21 +99,108 @@ struct ufs_data {
 	unsigned char silent;
 	unsigned char force;
 	unsigned char readonly;
+	unsigned char direct_io;
 	char *mnt_point;
 	char *options;
 	char *device;
 	char *volname;
+	char *backend;		/* device I/O backend, "name[:args]" */
+	size_t cache_size;	/* block cache budget in bytes, 0 disables */
+	int inode_cache;	/* inode blocks kept in memory */
+	int inode_flush;	/* seconds inode writes may be held back */
+	int vnode_cache;	/* unreferenced vnodes kept in memory */
+	int dentry_cache;	/* directory entries cached for lookups */
+	size_t dirhash_mem;	/* budget for large directory hashes, in bytes */
+	int atime;		/* UFS_ATIME_* */
+	unsigned char lazytime;	/* keep timestamp-only changes in memory */
+	unsigned char readdirplus; /* readdir reads the inodes too */
 	uufsd_t ufs;
 };
 
-struct ufs_vnode {
+#define UFS_CACHELINE	64		/* slab objects are aligned to this */
+#define UFS_SLAB_CHUNK	(64 << 10)	/* slabs grow this much at a time */
+
+struct ufs_slab {
+	void	*us_free;	/* free objects, linked through their first word */
+	void	*us_chunks;	/* chunks, linked through their first line */
+	size_t	us_size;	/* object size, rounded to UFS_CACHELINE */
+	size_t	us_perchunk;	/* objects per chunk */
+	size_t	us_nfree;	/* objects on the free list */
+	size_t	us_total;	/* objects carved out so far */
+};
+
+void ufs_slab_init(struct ufs_slab *slab, size_t size);
+void *ufs_slab_alloc(struct ufs_slab *slab);
+void ufs_slab_free(struct ufs_slab *slab, void *obj);
+void ufs_slab_destroy(struct ufs_slab *slab);
+
+/*
+ * The in-core inode is split in two.  The hot part below is all that
+ * stays in memory for an unused inode on the vnode LRU: enough to find
+ * it and to answer stat.  The full struct inode (block pointers, the
+ * dinode copy and the kernel-derived fields) and the on-disk snapshot
+ * used for dirty tracking live in the cold part, which is read back in
+ * when the vnode is used again.
+ */
+struct ufs_vattr {
+	u_int64_t va_size;
+	u_int64_t va_blocks;
+	int64_t	va_atime;
+	int64_t	va_mtime;
+	int64_t	va_ctime;
+	u_int32_t va_uid;
+	u_int32_t va_gid;
+	u_int32_t va_gen;
+	u_int16_t va_mode;
+	int16_t	va_nlink;
+};
+
+struct ufs_vnode_cold {
 	struct inode inode;
+	struct ufs2_dinode ondisk;	/* dinode as last read or written */
+};
+
+struct ufs_vnode {
+	struct ufs_vnode **pprevhash,*nexthash;
+	TAILQ_ENTRY(ufs_vnode) lru;	/* unreferenced vnodes, most recent first */
 	uufsd_t *ufsp;
 	ino_t ino;
 	int count;
-	struct ufs_vnode **pprevhash,*nexthash;
+	struct ufs_vnode_cold *cold;	/* always there while count > 0 */
+	struct ufs_vattr attr;		/* valid while cold is not */
+};
+
+struct vnode_stats {
+	u_int64_t vs_hits;	/* lookups served by a vnode in memory */
+	u_int64_t vs_misses;	/* lookups that had to read the inode */
+	u_int64_t vs_evictions;	/* vnodes dropped to honour the limit */
+	u_int64_t vs_thawed;	/* hits that had to read the cold part back */
+	size_t	vs_active;	/* vnodes in memory */
+	size_t	vs_cold;	/* of those, with their cold part */
+	size_t	vs_cached;	/* of those, unreferenced ones kept around */
+	size_t	vs_bytes;	/* memory held by vnodes */
+	size_t	vs_limit;	/* most unreferenced vnodes kept */
+	u_int64_t vs_resizes;	/* times the hash table grew */
+	size_t	vs_buckets;	/* hash buckets */
+	size_t	vs_used;	/* of those, non-empty ones */
+	size_t	vs_maxchain;	/* longest hash chain */
 };
 
+struct dcache_stats {
+	u_int64_t ds_hits;	/* lookups answered with an inode */
+	u_int64_t ds_neghits;	/* lookups answered with "no such name" */
+	u_int64_t ds_misses;	/* lookups that had to search the directory */
+	u_int64_t ds_evictions;	/* entries dropped to honour the limit */
+	size_t	ds_entries;	/* entries cached */
+	size_t	ds_limit;	/* most entries cached */
+};
+
+void dcache_init(int max);
+int dcache_lookup(uufsd_t *ufs, ino_t dir, const char *name, int len, ino_t *ino);
+void dcache_enter(uufsd_t *ufs, ino_t dir, const char *name, int len, ino_t ino);
+void dcache_purge(uufsd_t *ufs, ino_t dir);
+void dcache_stats(struct dcache_stats *ds);
+
 union dinode {
 	struct ufs1_dinode dp1;
 	struct ufs2_dinode dp2;
@@ -113,6 +213,12 @@ static inline uufsd_t *current_ufs(void)
 	return (uufsd_t *)&(ufsdata->ufs);
 }
 
+static inline struct ufs_data *current_data(void)
+{
+	struct fuse_context *mycontext=fuse_get_context();
+	return (struct ufs_data *)mycontext->private_data;
+}
+
 #if ENABLE_DEBUG
 
 static inline void debug_printf (const char *function,
@@ -168,8 +274,25 @@ struct ufs_vnode *vnode_get(uufsd_t *ufs, ino_t ino);
 
 int vnode_put(struct ufs_vnode *vnode, int dirty);
 
+/* Fields of the in-core inode that differ from the on-disk copy */
+#define UFS_VNODE_SIZE		0x01
+#define UFS_VNODE_TIMES		0x02
+#define UFS_VNODE_MODE		0x04
+#define UFS_VNODE_OWNER		0x08
+#define UFS_VNODE_BLOCKS	0x10
+#define UFS_VNODE_LINKS		0x20
+#define UFS_VNODE_OTHER		0x40
+
+int vnode_dirty(struct ufs_vnode *vnode);
+int vnode_sync_all(uufsd_t *ufs);
+int vnode_stat(uufsd_t *ufs, ino_t ino, struct stat *st);
+int vnode_peekstat(uufsd_t *ufs, ino_t ino, struct stat *st);
+void vnode_cache_init(int max);
+int vnode_cache_purge(uufsd_t *ufs);
+void vnode_stats(struct vnode_stats *vs);
+
 static inline struct inode *vnode2inode(struct ufs_vnode *vnode) {
-	return (struct inode *)vnode;
+	return &vnode->cold->inode;
 }
 
 static inline struct ufs_vnode *inode2vnode(struct inode *inode) {
@@ -275,6 +398,23 @@ int ufs_dir_iterate(uufsd_t *ufs, ino_t dirino,
 					  char *buf,
                                           void  *priv_data),
                               void *priv_data);
+int ufs_dir_scan(uufsd_t *ufs, struct ufs_vnode *vnode, doff_t start, doff_t end,
+		 int (*func)(struct direct *dirent, int n, char *buf,
+			     void *priv_data),
+		 void *priv_data, doff_t *where);
+
+/* A name to search directory blocks for, see dirscan.c */
+struct ufs_dirkey {
+	u_int64_t dk_head[2] __attribute__((aligned(16))); /* d_namlen, name */
+	u_int64_t dk_mask[2];	/* bytes of dk_head that count */
+	int dk_bits;		/* the same, one bit per byte */
+	const char *dk_name;
+	int dk_len;
+};
+
+void ufs_dirkey_init(struct ufs_dirkey *key, const char *name, int len);
+int ufs_dirblk_find(const char *buf, int size, const struct ufs_dirkey *key,
+		    ino_t *ino);
 
 int blkread(struct uufsd *disk, ufs2_daddr_t blockno, void *data, size_t size);
 int blkwrite(struct uufsd *disk, ufs2_daddr_t blockno, void *data, size_t size);
@@ -284,6 +424,8 @@ void copy_ondisk_to_incore(uufsd_t *ufsp, struct inode *inode,
 			struct ufs2_dinode *dinop, ino_t ino);
 
 int ufs_write_inode(uufsd_t *ufs, ino_t ino, struct ufs_vnode *vnode);
+int ufs_sync_inode(uufsd_t *ufs, struct ufs_vnode *vnode);
+void ufs_touch_atime(uufsd_t *ufs, struct ufs_vnode *vnode);
 
 int ufs_unlink(uufsd_t *ufs, ino_t d_dest_ino, char *r_dest, ino_t src_ino, int flags);
 int ufs_link(uufsd_t *ufs, ino_t dir_ino, char *r_dest, struct ufs_vnode *vnode, int mode);
@@ -305,6 +447,7 @@ int ufs_file_open2(uufsd_t *fs, ino_t ino, struct ufs_vnode *vnode,
 			    int flags, ufs_file_t *ret);
 int ufs_file_close2(ufs_file_t file,
 		    void (*close_callback) (struct ufs_vnode *inode, int flags));
+void ufs_file_cache_drain(uufsd_t *fs);
 int ufs_file_set_size(ufs_file_t file, __u64 size);
 int ufs_free_inode(uufsd_t *ufs, struct ufs_vnode *vnode, ino_t ino, int mode);
 ufs2_daddr_t ufs_inode_alloc(struct inode *ip, int cg, ufs2_daddr_t ipref, int mode);
@@ -48,10 +48,12 @@ int op_chmod (const char *path, mode_t mode)
 	inode = vnode2inode(vnode);
 
 	mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID | S_ISVTX;
-	inode->i_mode = (inode->i_mode & ~mask) | (mode & mask);
-	inode->i_ctime = time(NULL);
+	if ((inode->i_mode & mask) != (mode & mask)) {
+		inode->i_mode = (inode->i_mode & ~mask) | (mode & mask);
+		inode->i_ctime = time(NULL);
+	}
 
-	rc = vnode_put(vnode,1);
+	rc = vnode_put(vnode, vnode_dirty(vnode) != 0);
 	if (rc) {
 		debugf("vnode_put(vnode,1); failed");
 		return -EIO;
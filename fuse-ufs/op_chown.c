@@ -40,12 +40,16 @@ int op_chown (const char *path, uid_t uid, gid_t gid)
 	}
 	inode = vnode2inode(vnode);
 	
-	if (uid != -1)
-		inode->i_gid = gid;
-	if (gid != -1)
+	if (uid != -1 && inode->i_uid != uid) {
 		inode->i_uid = uid;
+		inode->i_ctime = time(NULL);
+	}
+	if (gid != -1 && inode->i_gid != gid) {
+		inode->i_gid = gid;
+		inode->i_ctime = time(NULL);
+	}
 
-	rc=vnode_put(vnode,1);
+	rc = vnode_put(vnode, vnode_dirty(vnode) != 0);
 	if (rc) {
 		debugf("vnode_put(vnode,1); failed");
 		return -EIO;
@@ -22,9 +22,30 @@
 void op_destroy (void *userdata)
 {
 	int rc;
+	const char *err;
 	uufsd_t *ufs = current_ufs();
 	struct fs *fs = &ufs->d_fs;
 	int i;
+	struct bcache_stats bs;
+	struct vnode_stats vs;
+	struct dcache_stats ds;
+	struct dirhash_stats dhs;
+
+	ufsdirhash_stats(&dhs);
+	/* Purge even if a write-back failed: nothing may outlive the disk */
+	rc = vnode_sync_all(ufs);
+	err = ufs->d_error;
+	if (vnode_cache_purge(ufs)) {
+		rc = -1;
+		err = ufs->d_error;
+	}
+	if (rc) {
+		fprintf(stderr, "Unable to write back inodes: %s\n",
+			err != NULL ? err : strerror(EIO));
+	}
+	ufs_file_cache_drain(ufs);
+	dcache_stats(&ds);
+	dcache_purge(ufs, 0);
 
 	if (fs->fs_fmod) {
 		for (i = 0; i < fs->fs_cssize; i += fs->fs_bsize) {
@@ -40,6 +61,31 @@ void op_destroy (void *userdata)
 	}
 
 	debugf("enter");
+	bcache_stats(ufs, &bs);
+	debugf("block cache: %llu hits, %llu misses, %llu read ahead, %llu writebacks, %llu evictions",
+	       (unsigned long long)bs.bs_hits, (unsigned long long)bs.bs_misses,
+	       (unsigned long long)bs.bs_prefetches,
+	       (unsigned long long)bs.bs_writebacks, (unsigned long long)bs.bs_evictions);
+	vnode_stats(&vs);
+	debugf("vnode cache: %llu hits (%llu thawed), %llu misses, %llu evictions, %zu vnodes (%zu unused, %zu cold) in %zu bytes",
+	       (unsigned long long)vs.vs_hits, (unsigned long long)vs.vs_thawed,
+	       (unsigned long long)vs.vs_misses,
+	       (unsigned long long)vs.vs_evictions, vs.vs_active, vs.vs_cached,
+	       vs.vs_cold, vs.vs_bytes);
+	debugf("dentry cache: %llu hits, %llu negative hits, %llu misses, %llu evictions, %zu entries",
+	       (unsigned long long)ds.ds_hits, (unsigned long long)ds.ds_neghits,
+	       (unsigned long long)ds.ds_misses,
+	       (unsigned long long)ds.ds_evictions, ds.ds_entries);
+	debugf("dirhash: %llu built, %llu hits, %llu misses (%llu by filter), %llu recycled, %llu filter rebuilds, %zu hashes in %zu bytes",
+	       (unsigned long long)dhs.dhs_builds, (unsigned long long)dhs.dhs_hits,
+	       (unsigned long long)dhs.dhs_misses,
+	       (unsigned long long)dhs.dhs_bloomneg,
+	       (unsigned long long)dhs.dhs_recycles,
+	       (unsigned long long)dhs.dhs_bloomrebuilds,
+	       dhs.dhs_hashes, dhs.dhs_mem);
+	debugf("vnode hash: %zu buckets (%zu used), longest chain %zu, grown %llu times",
+	       vs.vs_buckets, vs.vs_used, vs.vs_maxchain,
+	       (unsigned long long)vs.vs_resizes);
 	rc = ufs_disk_close(ufs);
 	if (rc) {
 		debugf("Error while trying to close ufs filesystem");
@@ -22,6 +22,7 @@
 int op_fsync (const char *path, int datasync, struct fuse_file_info *fi)
 {
 	int rc;
+	ufs_file_t file;
 	uufsd_t *ufs = current_ufs();
 
 	RETURN_IF_RDONLY(ufs);
@@ -29,11 +30,25 @@ int op_fsync (const char *path, int datasync, struct fuse_file_info *fi)
 	debugf("enter");
 	debugf("path = %s (%p)", path, fi);
 	
+	/* Timestamps lazytime held back in memory go out now */
+	file = fi != NULL ? UFS_FILE(fi->fh) : NULL;
+	if (file != NULL) {
+		rc = ufs_sync_inode(ufs, file->inode);
+		if (rc) {
+			return -EIO;
+		}
+	}
+
 	rc = sbwrite(ufs, 1);
 	if (rc) {
 		return -EIO;
 	}
 
+	rc = ufs_disk_sync(ufs);
+	if (rc) {
+		return -EIO;
+	}
+
 	debugf("leave");
 	return 0;
 }
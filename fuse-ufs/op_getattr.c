@@ -23,7 +23,6 @@ int op_getattr (const char *path, struct stat *stbuf)
 {
 	int rt;
 	ino_t ino;
-	struct ufs_vnode *vnode;
 	uufsd_t *ufs = current_ufs();
 
 	debugf("enter");
@@ -35,14 +34,17 @@ int op_getattr (const char *path, struct stat *stbuf)
 		return rt;
 	}
 
-	rt = do_readvnode(ufs, path, &ino, &vnode);
+	rt = ufs_namei(ufs, ROOTINO, ROOTINO, path, &ino);
+	if (rt || !ino) {
+		debugf("ufs_namei(ufs, ROOTINO, ROOTINO, %s, &ino); failed", path);
+		return -ENOENT;
+	}
+	debugf("Resolved %s to inode %d\n", path, (int)ino);
+	rt = vnode_stat(ufs, ino, stbuf);
 	if (rt) {
-		debugf("do_readvnode(%s, &ino, &vnode); failed", path);
+		debugf("vnode_stat(ufs, %d, stbuf); failed", (int)ino);
 		return rt;
 	}
-	debugf("Resolved %s to inode %d\n", path, (int)ino);
-	do_fillstatbuf(ufs, ino, vnode2inode(vnode), stbuf);
-	vnode_put(vnode,0);
 
 	debugf("leave");
 	return 0;
@@ -37,6 +37,38 @@ void * op_init (struct fuse_conn_info *conn)
 		exit(1);
 	}
 
+	if (ufsdata->direct_io && ufs_disk_directio(&ufsdata->ufs) == -1) {
+		debugf("Unable to use direct I/O on %s: %s", ufsdata->device,
+		       ufsdata->ufs.d_error);
+		exit(1);
+	}
+
+	if (ufsdata->backend != NULL &&
+	    ufs_disk_backend(&ufsdata->ufs, ufsdata->backend) == -1) {
+		debugf("Unable to use backend %s: %s", ufsdata->backend,
+		       ufsdata->ufs.d_error);
+		exit(1);
+	}
+	if (!ufsdata->readonly && ufsdata->ufs.d_backend->ub_write == NULL) {
+		debugf("Backend %s only supports read-only mounts",
+		       ufsdata->ufs.d_backend->ub_name);
+		exit(1);
+	}
+
+	if (bcache_init(&ufsdata->ufs, ufsdata->cache_size) == -1) {
+		debugf("Unable to set up block cache: %s", ufsdata->ufs.d_error);
+		exit(1);
+	}
+	if (inocache_init(&ufsdata->ufs, ufsdata->inode_cache,
+	    ufsdata->inode_flush) == -1) {
+		debugf("Unable to set up inode cache: %s", ufsdata->ufs.d_error);
+		exit(1);
+	}
+	vnode_cache_init(ufsdata->vnode_cache);
+	dcache_init(ufsdata->dentry_cache);
+	/* A hash is only as long-lived as the vnode it hangs off */
+	ufsdirhash_init(ufsdata->vnode_cache ? ufsdata->dirhash_mem : 0);
+
 	fs = &ufsdata->ufs.d_fs;
 
 	buf = malloc(fs->fs_bsize);
@@ -95,7 +95,7 @@ static int ufs_mkdir(uufsd_t *ufs, ino_t parent, ino_t inum, char *name)
 		retval = ufs_valloc(parent_vnode, DTTOIF(DT_DIR), &vnode);
 		if (retval)
 			goto cleanup;
-		ino = vnode->inode.i_number;
+		ino = vnode2inode(vnode)->i_number;
 		inode = vnode2inode(vnode);
 	}
 
@@ -109,7 +109,7 @@ static int ufs_mkdir(uufsd_t *ufs, ino_t parent, ino_t inum, char *name)
 	/*
 	 * Create a scratch template for the directory
 	 */
-	retval = ufs_new_dir_block(ufs, vnode->inode.i_number, parent_vnode, &block);
+	retval = ufs_new_dir_block(ufs, vnode2inode(vnode)->i_number, parent_vnode, &block);
 	if (retval)
 		goto cleanup;
 
@@ -38,6 +38,9 @@ int op_read (const char *path, char *buf, size_t size, off_t offset, struct fuse
 	if (rc) {
 		return -EIO;
 	}
+	if (bytes > 0) {
+		ufs_touch_atime(file->fs, file->inode);
+	}
 
 	debugf("leave");
 	return bytes;
@@ -19,44 +19,94 @@
 
 #include "fuse-ufs.h"
 
+/*
+ * Directories are read in offset mode: every entry is passed to the
+ * filler with a cookie, the directory offset of the entry after it, and
+ * the next call resumes from the cookie it is handed back.  An offset
+ * names both the DIRBLKSIZ block and the position in it, and the entries
+ * of a block are walked from its start, which is always an entry, so a
+ * cookie stays good when the entry it points at is removed meanwhile.
+ *
+ * Every entry carries its file type, from d_type, which is all the
+ * kernel keeps of it.  With the readdirplus mount option the inodes of
+ * a block's entries are also read, the inode blocks holding them as a
+ * single batch, and the entries carry their full attributes; the stat
+ * calls that may follow a listing then find the inodes in memory
+ * instead of reading them one by one.
+ */
 struct dir_walk_data {
+	uufsd_t *ufs;
 	char *buf;
 	fuse_fill_dir_t filler;
+	int plus;		/* fill in full attributes */
+	doff_t start;		/* entries before this were already returned */
+	doff_t chunk;		/* offset of the DIRBLKSIZ block being walked */
 };
 
+/*
+ * Read in the inode blocks for the entries of the DIRBLKSIZ block at
+ * dirblock that are still to be returned.
+ */
+static void prefetch_inodes (struct dir_walk_data *b, char *dirblock)
+{
+	ino_t inos[DIRBLKSIZ / 12];	/* an entry takes at least 12 bytes */
+	struct direct *de;
+	int offset, n;
+
+	for (n = 0, offset = 0; offset < DIRBLKSIZ &&
+	     n < (int)(sizeof(inos) / sizeof(inos[0])); offset += de->d_reclen) {
+		de = (struct direct *)(dirblock + offset);
+		/* Raw block: stop at anything that is not a sane entry */
+		if (de->d_reclen < DIRECTSIZ(1) ||
+		    (de->d_reclen & (DIRALIGN - 1)) ||
+		    offset + de->d_reclen > DIRBLKSIZ) {
+			break;
+		}
+		if (de->d_ino != 0 && b->chunk + offset >= b->start) {
+			inos[n++] = de->d_ino;
+		}
+	}
+	if (n > 0 && inocache_prefetch(b->ufs, inos, n) == -1) {
+		debugf("inocache_prefetch failed: %s", b->ufs->d_error);
+	}
+}
+
 static int walk_dir (struct direct *de, int offset, char *buf, void *priv_data)
 {
-	int ret;
-	size_t flen;
-	char *fname;
 	struct dir_walk_data *b = priv_data;
 	struct stat st;
-	memset(&st, 0, sizeof(st));
+	doff_t off;
+
+	/* Each block is walked from its first entry */
+	if (offset == 0) {
+		b->chunk += DIRBLKSIZ;
+		if (b->plus) {
+			prefetch_inodes(b, buf);
+		}
+	}
+	off = b->chunk + offset;
 
 	if (de->d_ino==0) /* skip unused dentry */
 		return 0;
+	if (off < b->start)
+		return 0;
 
-	debugf("enter");
-
-	st.st_ino=de->d_ino;
+	if (!b->plus || vnode_peekstat(b->ufs, de->d_ino, &st) != 0) {
+		memset(&st, 0, sizeof(st));
+		st.st_ino=de->d_ino;
 #if !defined __x86_64__ && defined __USE_FILE_OFFSET64
-	st.__st_ino=de->d_ino;
+		st.__st_ino=de->d_ino;
 #endif
-//	st.st_mode=type<<12;
-
-	flen = de->d_namlen & 0xff;
-	fname = (char *) malloc(sizeof(char) * (flen + 1));
-	if (fname == NULL) {
-		debugf("s = (char *) malloc(sizeof(char) * (%d + 1)); failed", flen);
-		return -ENOMEM;
+		st.st_mode=DTTOIF(de->d_type);
 	}
-	snprintf(fname, flen + 1, "%s", de->d_name);
-	debugf("b->filler(b->buf, %s, NULL, 0);", fname);
-	ret = b->filler(b->buf, fname, &st, 0);
-	free(fname);
 
-	debugf("leave");
-	return ret;
+	/* The name is handed over from the block buffer, which is ours */
+	de->d_name[de->d_namlen & 0xff] = '\0';
+	if (b->filler(b->buf, de->d_name, &st, off + de->d_reclen)) {
+		/* Buffer full: the next call starts over from this entry */
+		return DIRENT_ABORT;
+	}
+	return 0;
 }
 
 int op_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
@@ -64,13 +114,15 @@ int op_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 	int rt;
 	ino_t ino;
 	struct ufs_vnode *vnode;
+	uufsd_t *ufs = current_ufs();
 	struct dir_walk_data dwd={
+		.ufs = ufs,
 		.buf = buf,
-		.filler = filler};
-	uufsd_t *ufs = current_ufs();
+		.filler = filler,
+		.plus = current_data()->readdirplus};
 
 	debugf("enter");
-	debugf("path = %s", path);
+	debugf("path = %s, offset = %lld", path, (long long)offset);
 
 	rt = do_readvnode(ufs, path, &ino, &vnode);
 	if (rt) {
@@ -78,14 +130,23 @@ int op_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 		return rt;
 	}
 
-	rt = ufs_dir_iterate(ufs, ino, walk_dir, &dwd);
+	if (offset < 0 || offset >= (off_t)vnode2inode(vnode)->i_size) {
+		/* Past the end, or a cookie we never handed out */
+		goto out;
+	}
+	dwd.start = offset;
+	dwd.chunk = (offset & ~(DIRBLKSIZ - 1)) - DIRBLKSIZ;
+	rt = ufs_dir_scan(ufs, vnode, offset & ~(DIRBLKSIZ - 1),
+			  vnode2inode(vnode)->i_size, walk_dir, &dwd, NULL);
 	if (rt) {
-		debugf("Error while trying to ufs_dir_iterate %s", path);
+		debugf("Error while trying to ufs_dir_scan %s", path);
 		vnode_put(vnode, 0);
 		return -EIO;
 	}
 
-	vnode_put(vnode, 0);
+out:
+	ufs_touch_atime(ufs, vnode);
+	vnode_put(vnode, vnode_dirty(vnode) != 0);
 	debugf("leave");
 	return 0;
 }
@@ -50,6 +50,7 @@ static int do_fix_dotdot(uufsd_t *ufs, ino_t ino, ino_t dotdot)
 		debugf("while iterating over directory");
 		return -EIO;
 	}
+	dcache_enter(ufs, ino, "..", 2, dotdot);
 	debugf("leave");
 	return 0;
 }
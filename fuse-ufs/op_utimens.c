@@ -38,9 +38,9 @@ int op_utimens (const char *path, const struct timespec tv[2])
 	inode = vnode2inode(vnode);
 
 	inode->i_atime = tv[0].tv_sec;
-	inode->i_mtime = tv[0].tv_sec;
+	inode->i_mtime = tv[1].tv_sec;
 
-	rt = vnode_put(vnode, 1);
+	rt = vnode_put(vnode, vnode_dirty(vnode) != 0);
 	if (rt) {
 		debugf("vnode_put(vnode,1); failed");
 		return -EIO;
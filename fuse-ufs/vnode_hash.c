@@ -21,84 +21,465 @@
 
 //#define VNODE_DEBUG 1
 
-#define VNODE_HASH_SIZE 256
-#define VNODE_HASH_MASK (VNODE_HASH_SIZE-1)
+#define VNODE_HASH_SIZE 256	/* initial number of buckets */
+#define VNODE_HASH_LOAD 2	/* vnodes per bucket that trigger growth */
+#define VNODE_REHASH_STEP 4	/* old buckets moved per lookup while growing */
 
 #if !defined(VNODE_DEBUG)
 #undef debugf
 #define debugf(a...) do { } while (0)
 #endif
 
-static struct ufs_vnode *ht_head[VNODE_HASH_SIZE];
+/*
+ * The hash table doubles when the vnode population outgrows it.  The
+ * old table is then drained into the new one a few buckets per lookup
+ * rather than all at once; until bucket vt_migrate of the old table has
+ * been moved, the vnodes hashing to it are still found there.
+ */
+struct vnode_table {
+	struct ufs_vnode **vt_head;
+	size_t vt_mask;
+};
+
+static struct vnode_table vt_cur, vt_old;
+static size_t vt_migrate;
+
+/*
+ * Vnodes nobody holds a reference to stay hashed on an LRU list, most
+ * recently used first, so that the next lookup of a hot inode needs no
+ * inode block read.  At most vnode_max of them are kept.
+ */
+static TAILQ_HEAD(vnode_lru, ufs_vnode) vnode_lru =
+	TAILQ_HEAD_INITIALIZER(vnode_lru);
+static int vnode_max = UFS_DEF_VNODE_CACHE;
+static struct vnode_stats vnode_st;
+
+static struct ufs_slab vnode_slab, cold_slab;
 
 static inline struct ufs_vnode * vnode_alloc (void)
 {
 	struct ufs_vnode *new;
-	new = (struct ufs_vnode *) malloc(sizeof(struct ufs_vnode));
+
+	if (vnode_slab.us_size == 0) {
+		ufs_slab_init(&vnode_slab, sizeof(struct ufs_vnode));
+		ufs_slab_init(&cold_slab, sizeof(struct ufs_vnode_cold));
+	}
+	new = (struct ufs_vnode *) ufs_slab_alloc(&vnode_slab);
 	if (new) {
 		bzero(new, sizeof(struct ufs_vnode));
+		vnode_st.vs_active++;
+		vnode_st.vs_bytes += vnode_slab.us_size;
 	}
 	return new;
 }
 
+/*
+ * Drop the cold part of a vnode nobody uses, keeping what stat needs.
+ */
+static void vnode_freeze (struct ufs_vnode *vnode)
+{
+	struct inode *inode = vnode2inode(vnode);
+	struct ufs_vattr *va = &vnode->attr;
+
+	va->va_size = inode->i_size;
+	va->va_blocks = inode->i_blocks;
+	va->va_atime = inode->i_atime;
+	va->va_mtime = inode->i_mtime;
+	va->va_ctime = inode->i_ctime;
+	va->va_uid = inode->i_uid;
+	va->va_gid = inode->i_gid;
+	va->va_gen = inode->i_gen;
+	va->va_mode = inode->i_mode;
+	va->va_nlink = inode->i_nlink;
+
+	ufs_slab_free(&cold_slab, vnode->cold);
+	vnode->cold = NULL;
+	vnode_st.vs_cold--;
+	vnode_st.vs_bytes -= cold_slab.us_size;
+}
+
+/*
+ * Give a vnode its cold part, from the inode block.
+ */
+static int vnode_thaw (struct ufs_vnode *vnode)
+{
+	struct ufs_vnode_cold *cold;
+	struct ufs2_dinode *dinop = NULL;
+	int mode;
+
+	cold = (struct ufs_vnode_cold *) ufs_slab_alloc(&cold_slab);
+	if (cold == NULL) {
+		return -1;
+	}
+	bzero(cold, sizeof(*cold));
+	if (vnode->ino) {
+		if (getino(vnode->ufsp, (void **)&dinop, vnode->ino, &mode) != 0) {
+			ufs_slab_free(&cold_slab, cold);
+			return -1;
+		}
+		copy_ondisk_to_incore(vnode->ufsp, &cold->inode, dinop, vnode->ino);
+		cold->ondisk = *dinop;
+	}
+	cold->inode.i_vnode = (struct vnode *)vnode;
+	vnode->cold = cold;
+	vnode_st.vs_cold++;
+	vnode_st.vs_bytes += cold_slab.us_size;
+	return 0;
+}
+
 static inline void vnode_free (struct ufs_vnode *vnode)
 {
+	if (vnode->cold != NULL) {
+		ufsdirhash_free(vnode2inode(vnode));
+		ufs_slab_free(&cold_slab, vnode->cold);
+		vnode->cold = NULL;
+		vnode_st.vs_cold--;
+		vnode_st.vs_bytes -= cold_slab.us_size;
+	}
 	vnode->ino = 0;
-	free(vnode);
+	vnode_st.vs_active--;
+	vnode_st.vs_bytes -= vnode_slab.us_size;
+	ufs_slab_free(&vnode_slab, vnode);
+}
+
+static inline void vnode_unhash (struct ufs_vnode *vnode)
+{
+	*(vnode->pprevhash) = vnode->nexthash;
+	if (vnode->nexthash) {
+		vnode->nexthash->pprevhash = vnode->pprevhash;
+	}
+}
+
+/*
+ * Drop the least recently used unreferenced vnode, writing back what
+ * it still holds in memory.
+ */
+static int vnode_evict (struct ufs_vnode *vnode)
+{
+	int rt = 0;
+
+	debugf("evicting hash:%p", vnode);
+	TAILQ_REMOVE(&vnode_lru, vnode, lru);
+	vnode_st.vs_cached--;
+	vnode_st.vs_evictions++;
+	if (vnode->cold != NULL && !vnode->ufsp->d_fs.fs_ronly) {
+		rt = ufs_sync_inode(vnode->ufsp, vnode);
+	}
+	vnode_unhash(vnode);
+	vnode_free(vnode);
+	return rt;
+}
+
+void vnode_cache_init (int max)
+{
+	vnode_max = max < 0 ? 0 : max;
 }
 
-static inline int vnode_hash_key(uufsd_t *ufsp, ino_t ino)
+static inline u_int64_t vnode_hash_key(uufsd_t *ufsp, ino_t ino)
 {
-	return ((int) ufsp + ino) & VNODE_HASH_MASK;
+	u_int64_t h = (u_int64_t)(uintptr_t)ufsp ^
+		((u_int64_t)ino * 0x9e3779b97f4a7c15ULL);
+
+	/* murmur3 finalizer: every key bit reaches the low bits */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static struct ufs_vnode **vnode_bucket(u_int64_t h)
+{
+	if (vt_old.vt_head != NULL && (h & vt_old.vt_mask) >= vt_migrate) {
+		return &vt_old.vt_head[h & vt_old.vt_mask];
+	}
+	return &vt_cur.vt_head[h & vt_cur.vt_mask];
+}
+
+static void vnode_hash_insert(struct ufs_vnode **head, struct ufs_vnode *vnode)
+{
+	if (*head != NULL) {
+		(*head)->pprevhash = &(vnode->nexthash);
+	}
+	vnode->nexthash = *head;
+	vnode->pprevhash = head;
+	*head = vnode;
+}
+
+/*
+ * Move the next few buckets of the old table over, and free it once it
+ * is empty.
+ */
+static void vnode_rehash_step(void)
+{
+	struct ufs_vnode *vnode;
+	int n;
+
+	for (n = 0; n < VNODE_REHASH_STEP && vt_old.vt_head != NULL; n++) {
+		while ((vnode = vt_old.vt_head[vt_migrate]) != NULL) {
+			vnode_unhash(vnode);
+			vnode_hash_insert(&vt_cur.vt_head[vnode_hash_key(vnode->ufsp,
+			    vnode->ino) & vt_cur.vt_mask], vnode);
+		}
+		if (vt_migrate++ == vt_old.vt_mask) {
+			free(vt_old.vt_head);
+			vt_old.vt_head = NULL;
+			vt_migrate = 0;
+		}
+	}
+}
+
+/*
+ * Set up the table on first use, and start doubling it when the load
+ * gets too high.  Without memory the table simply stays as it is.
+ */
+static int vnode_hash_grow(void)
+{
+	struct ufs_vnode **head;
+	size_t size;
+
+	if (vt_cur.vt_head == NULL) {
+		size = VNODE_HASH_SIZE;
+	} else if (vt_old.vt_head == NULL &&
+	    vnode_st.vs_active > (vt_cur.vt_mask + 1) * VNODE_HASH_LOAD) {
+		size = (vt_cur.vt_mask + 1) * 2;
+	} else {
+		return 0;
+	}
+	head = calloc(size, sizeof(*head));
+	if (head == NULL) {
+		return vt_cur.vt_head != NULL ? 0 : -1;
+	}
+	if (vt_cur.vt_head != NULL) {
+		vt_old = vt_cur;
+		vt_migrate = 0;
+		vnode_st.vs_resizes++;
+	}
+	vt_cur.vt_head = head;
+	vt_cur.vt_mask = size - 1;
+	return 0;
+}
+
+/*
+ * Inode updates held back by inode_flush have no timer of their own;
+ * every inode use is a chance to write them once their time is up.
+ */
+static inline void vnode_flush_tick (uufsd_t *ufsp)
+{
+	if (inocache_tick(ufsp) == -1) {
+		debugf("inocache_tick failed: %s", ufsp->d_error);
+	}
 }
 
 struct ufs_vnode * vnode_get(uufsd_t *ufsp, ino_t ino)
 {
-	int hash_key = vnode_hash_key(ufsp, ino);
-	struct ufs_vnode *rv = ht_head[hash_key];
+	u_int64_t hash_key = vnode_hash_key(ufsp, ino);
+	struct ufs_vnode *rv;
 
-	while (rv != NULL && rv->ino != ino) {
+	vnode_flush_tick(ufsp);
+	if (vnode_hash_grow() == -1) {
+		return NULL;
+	}
+	vnode_rehash_step();
+	rv = *vnode_bucket(hash_key);
+	while (rv != NULL && (rv->ino != ino || rv->ufsp != ufsp)) {
 		rv = rv->nexthash;
 	}
 	if (rv != NULL) {
 //		rv->retaddr[rv->count] = __builtin_return_address(0);
+		if (rv->cold == NULL) {
+			if (vnode_thaw(rv) == -1) {
+				debugf("leave error");
+				return NULL;
+			}
+			vnode_st.vs_thawed++;
+		}
+		if (rv->count == 0) {
+			TAILQ_REMOVE(&vnode_lru, rv, lru);
+			vnode_st.vs_cached--;
+		}
+		vnode_st.vs_hits++;
 		rv->count++;
 		debugf("increased hash:%p use count:%d", rv, rv->count);
 		return rv;
 	} else {
 		struct ufs_vnode *new = vnode_alloc();
+		vnode_st.vs_misses++;
 		if (new != NULL) {
-			int rc;
-			int mode;
-			struct ufs2_dinode *dinop = NULL;
-
-			if (ino) {
-				rc = getino(ufsp, (void **)&dinop, ino, &mode);
-				if (rc != 0) {
-					vnode_free(new);
-					debugf("leave error");
-					return NULL;
-				}
-				copy_ondisk_to_incore(ufsp, &new->inode, dinop, ino);
-			}
-
-			new->inode.i_vnode = (struct vnode *)new;
 			new->ufsp = ufsp;
 			new->ino = ino;
+			if (vnode_thaw(new) == -1) {
+				vnode_free(new);
+				debugf("leave error");
+				return NULL;
+			}
 			new->count = 1;
 
-			if (ht_head[hash_key] != NULL) {
-				ht_head[hash_key]->pprevhash = &(new->nexthash);
-			}
-			new->nexthash = ht_head[hash_key];
-			new->pprevhash = &(ht_head[hash_key]);
-			ht_head[hash_key] = new;
+			vnode_hash_insert(vnode_bucket(hash_key), new);
 			debugf("added hash:%p", new);
 		}
 		return new;
 	}
 }
 
+static void vattr_fillstat (uufsd_t *ufsp, ino_t ino, struct ufs_vattr *va,
+	struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = (dev_t) ((long) ufsp);
+	st->st_ino = ino;
+#if !defined __x86_64__ && defined __USE_FILE_OFFSET64
+	st->__st_ino = ino;
+#endif
+	st->st_mode = va->va_mode;
+	st->st_nlink = va->va_nlink;
+	st->st_uid = va->va_uid;
+	st->st_gid = va->va_gid;
+	st->st_size = va->va_size;
+#if __FreeBSD__ == 10
+	st->st_gen = va->va_gen;
+#endif
+	st->st_blksize = ufsp->d_fs.fs_fsize;
+	st->st_blocks = va->va_blocks;
+	st->st_atime = va->va_atime;
+	st->st_mtime = va->va_mtime;
+	st->st_ctime = va->va_ctime;
+}
+
+static struct ufs_vnode * vnode_find (uufsd_t *ufsp, ino_t ino)
+{
+	struct ufs_vnode *vnode;
+
+	vnode_flush_tick(ufsp);
+	vnode_rehash_step();
+	vnode = vt_cur.vt_head != NULL ?
+		*vnode_bucket(vnode_hash_key(ufsp, ino)) : NULL;
+	while (vnode != NULL && (vnode->ino != ino || vnode->ufsp != ufsp)) {
+		vnode = vnode->nexthash;
+	}
+	return vnode;
+}
+
+/*
+ * stat(2) an inode.  An unused vnode on the LRU answers from its hot
+ * part, without reading the inode back in.
+ */
+int vnode_stat (uufsd_t *ufsp, ino_t ino, struct stat *st)
+{
+	struct ufs_vnode *vnode;
+
+	vnode = vnode_find(ufsp, ino);
+	if (vnode == NULL || vnode->cold != NULL) {
+		vnode = vnode_get(ufsp, ino);
+		if (vnode == NULL) {
+			return -EIO;
+		}
+		do_fillstatbuf(ufsp, ino, vnode2inode(vnode), st);
+		vnode_put(vnode, 0);
+		return 0;
+	}
+
+	vnode_st.vs_hits++;
+	TAILQ_REMOVE(&vnode_lru, vnode, lru);
+	TAILQ_INSERT_HEAD(&vnode_lru, vnode, lru);
+	vattr_fillstat(ufsp, ino, &vnode->attr, st);
+	return 0;
+}
+
+/*
+ * stat(2) an inode for readdir.  Unlike vnode_stat() this neither
+ * creates a vnode nor moves one on the LRU, so that listing a large
+ * directory does not push out the vnodes that are really in use; an
+ * inode without a vnode is read straight from the inode block cache.
+ */
+int vnode_peekstat (uufsd_t *ufsp, ino_t ino, struct stat *st)
+{
+	struct ufs_vnode *vnode;
+	struct ufs2_dinode *dinop = NULL;
+	struct inode inode;
+
+	vnode = vnode_find(ufsp, ino);
+	if (vnode != NULL && vnode->cold == NULL) {
+		vattr_fillstat(ufsp, ino, &vnode->attr, st);
+		return 0;
+	}
+	if (vnode != NULL) {
+		do_fillstatbuf(ufsp, ino, vnode2inode(vnode), st);
+		return 0;
+	}
+	if (getino(ufsp, (void **)&dinop, ino, NULL) != 0) {
+		return -EIO;
+	}
+	copy_ondisk_to_incore(ufsp, &inode, dinop, ino);
+	do_fillstatbuf(ufsp, ino, &inode, st);
+	return 0;
+}
+
+/*
+ * Work out which fields of the in-core inode have changed since it was
+ * read from or last written to disk.  Returns a mask of UFS_VNODE_*
+ * bits, 0 if writing the inode back would not change anything.
+ */
+int vnode_dirty (struct ufs_vnode *vnode)
+{
+	struct ufs2_dinode din, *old;
+	int i, dirty = 0;
+
+	if (vnode->ino == 0 || vnode->cold == NULL) {
+		return 0;
+	}
+	old = &vnode->cold->ondisk;
+	din = *UFS_DINODE(vnode2inode(vnode));
+	copy_incore_to_ondisk(vnode2inode(vnode), &din);
+	/*
+	 * di_blocks is recomputed from the size, which is only a guess
+	 * for sparse files; don't let the guess alone dirty the inode.
+	 */
+	if (din.di_size == old->di_size) {
+		din.di_blocks = old->di_blocks;
+	}
+
+	if (din.di_size != old->di_size) {
+		dirty |= UFS_VNODE_SIZE;
+	}
+	if (din.di_atime != old->di_atime || din.di_mtime != old->di_mtime ||
+	    din.di_ctime != old->di_ctime || din.di_birthtime != old->di_birthtime ||
+	    din.di_atimensec != old->di_atimensec ||
+	    din.di_mtimensec != old->di_mtimensec ||
+	    din.di_ctimensec != old->di_ctimensec ||
+	    din.di_birthnsec != old->di_birthnsec) {
+		dirty |= UFS_VNODE_TIMES;
+	}
+	if (din.di_mode != old->di_mode || din.di_flags != old->di_flags) {
+		dirty |= UFS_VNODE_MODE;
+	}
+	if (din.di_uid != old->di_uid || din.di_gid != old->di_gid) {
+		dirty |= UFS_VNODE_OWNER;
+	}
+	if (din.di_blocks != old->di_blocks) {
+		dirty |= UFS_VNODE_BLOCKS;
+	}
+	for (i = 0; i < NDADDR && !(dirty & UFS_VNODE_BLOCKS); i++) {
+		if (din.di_db[i] != old->di_db[i]) {
+			dirty |= UFS_VNODE_BLOCKS;
+		}
+	}
+	for (i = 0; i < NIADDR && !(dirty & UFS_VNODE_BLOCKS); i++) {
+		if (din.di_ib[i] != old->di_ib[i]) {
+			dirty |= UFS_VNODE_BLOCKS;
+		}
+	}
+	if (din.di_nlink != old->di_nlink) {
+		dirty |= UFS_VNODE_LINKS;
+	}
+	/* Generation, extattrs, symlink targets and the rest */
+	if (dirty == 0 && memcmp(&din, old, sizeof(din)) != 0) {
+		dirty |= UFS_VNODE_OTHER;
+	}
+	return dirty;
+}
+
 int vnode_put (struct ufs_vnode *vnode, int dirty)
 {
 	int rt = 0;
@@ -108,19 +489,137 @@ int vnode_put (struct ufs_vnode *vnode, int dirty)
 	}
 
 	if (vnode->count <= 0) {
-		debugf("deleting hash:%p", vnode);
-		if (vnode->inode.i_nlink < 1) {
-			rt = do_killfilebyinode(vnode->ufsp, vnode->ino, vnode);
-		} else if (dirty) {
+		if (vnode2inode(vnode)->i_nlink < 1 || vnode->ino == 0 ||
+		    vnode_max == 0) {
+			debugf("deleting hash:%p", vnode);
+			if (vnode2inode(vnode)->i_nlink < 1) {
+				rt = do_killfilebyinode(vnode->ufsp, vnode->ino, vnode);
+			} else if (vnode->ino != 0 && !vnode->ufsp->d_fs.fs_ronly) {
+				/* Last reference: nothing may stay behind in memory */
+				rt = ufs_sync_inode(vnode->ufsp, vnode);
+			}
+			vnode_unhash(vnode);
+			vnode_free(vnode);
+			return rt;
+		}
+		/*
+		 * Keep it around for the next lookup.  Whatever lazytime
+		 * holds back is written when it is evicted.
+		 */
+		vnode->count = 0;
+		if (!vnode->ufsp->d_fs.fs_ronly) {
 			rt = ufs_write_inode(vnode->ufsp, vnode->ino, vnode);
 		}
-		*(vnode->pprevhash) = vnode->nexthash;
-		if (vnode->nexthash) {
-			vnode->nexthash->pprevhash = vnode->pprevhash;
+		/*
+		 * Only the hot part stays, unless changes are held back or
+		 * the directory hash hanging off the inode is worth keeping.
+		 */
+		if (rt == 0 && vnode_dirty(vnode) == 0 &&
+		    vnode2inode(vnode)->i_dirhash == NULL) {
+			vnode_freeze(vnode);
+		}
+		TAILQ_INSERT_HEAD(&vnode_lru, vnode, lru);
+		vnode_st.vs_cached++;
+		while (vnode_st.vs_cached > (size_t)vnode_max) {
+			int rc = vnode_evict(TAILQ_LAST(&vnode_lru, vnode_lru));
+			if (rc) {
+				rt = rc;
+			}
 		}
-		vnode_free(vnode);
 	} else if (dirty) {
 		rt = ufs_write_inode(vnode->ufsp, vnode->ino, vnode);
 	}
 	return rt;
 }
+
+/*
+ * Write out every in-use vnode of ufs that has changes held back in
+ * memory, for fsync and unmount.
+ */
+int vnode_sync_all (uufsd_t *ufs)
+{
+	struct ufs_vnode *vnode;
+	size_t i;
+	int t, rc, rt = 0;
+
+	if (ufs->d_fs.fs_ronly) {
+		return 0;
+	}
+	for (t = 0; t < 2; t++) {
+		struct vnode_table *vt = t ? &vt_old : &vt_cur;
+
+		for (i = 0; vt->vt_head != NULL && i <= vt->vt_mask; i++) {
+			for (vnode = vt->vt_head[i]; vnode != NULL;
+			     vnode = vnode->nexthash) {
+				if (vnode->ufsp != ufs || vnode->ino == 0 ||
+				    vnode->cold == NULL ||
+				    vnode2inode(vnode)->i_nlink < 1) {
+					continue;
+				}
+				rc = ufs_sync_inode(ufs, vnode);
+				if (rc) {
+					rt = rc;
+				}
+			}
+		}
+	}
+	return rt;
+}
+
+/*
+ * Drop every unreferenced vnode of ufs, for unmount.
+ */
+int vnode_cache_purge (uufsd_t *ufs)
+{
+	struct ufs_vnode *vnode, *next;
+	int rc, rt = 0;
+
+	for (vnode = TAILQ_FIRST(&vnode_lru); vnode != NULL; vnode = next) {
+		next = TAILQ_NEXT(vnode, lru);
+		if (vnode->ufsp != ufs) {
+			continue;
+		}
+		rc = vnode_evict(vnode);
+		if (rc) {
+			rt = rc;
+		}
+	}
+	if (vnode_st.vs_active == 0) {
+		ufs_slab_destroy(&vnode_slab);
+		ufs_slab_destroy(&cold_slab);
+	}
+	return rt;
+}
+
+void vnode_stats (struct vnode_stats *vs)
+{
+	struct ufs_vnode *vnode;
+	size_t i, len;
+	int t;
+
+	*vs = vnode_st;
+	vs->vs_limit = (size_t)vnode_max;
+
+	/* Chain lengths, over both tables while one is being drained */
+	for (t = 0; t < 2; t++) {
+		struct vnode_table *vt = t ? &vt_old : &vt_cur;
+
+		if (vt->vt_head == NULL) {
+			continue;
+		}
+		vs->vs_buckets += vt->vt_mask + 1;
+		for (i = 0; i <= vt->vt_mask; i++) {
+			len = 0;
+			for (vnode = vt->vt_head[i]; vnode != NULL;
+			     vnode = vnode->nexthash) {
+				len++;
+			}
+			if (len > 0) {
+				vs->vs_used++;
+			}
+			if (len > vs->vs_maxchain) {
+				vs->vs_maxchain = len;
+			}
+		}
+	}
+}
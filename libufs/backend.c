@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Block device backends and the default pread(2)/pwrite(2) engine.
+ *
+ * A backend is picked with ufs_disk_backend() once the disk has been
+ * filled out, using a spec of the form "name[:args]".  The default
+ * backend stays in charge while the new one attaches, so a backend
+ * may read the device through pbread() from its ub_open routine.
+ */
+
+#ifndef _GNU_SOURCE
+#define	_GNU_SOURCE	/* fallocate(2) */
+#endif
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libufs.h>
+
+static ssize_t
+pread_read(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	void *p2;
+	ssize_t cnt;
+
+	ERROR(disk, NULL);
+
+	p2 = data;
+	/*
+	 * XXX: various disk controllers require alignment of our buffer
+	 * XXX: which is stricter than struct alignment, and O_DIRECT
+	 * XXX: needs sector alignment.
+	 * XXX: Bounce the buffer if not aligned to d_align.
+	 */
+	if (((intptr_t)data) & (disk->d_align - 1)) {
+		p2 = ufs_buf_alloc(disk, size);
+		if (p2 == NULL) {
+			ERROR(disk, "allocate bounce buffer");
+			p2 = data;
+			goto fail;
+		}
+	}
+	cnt = pread(disk->d_fd, p2, size, off);
+	if (cnt == -1) {
+		ERROR(disk, "read error from block device");
+		goto fail;
+	}
+	if (cnt == 0) {
+		ERROR(disk, "end of file from block device");
+		goto fail;
+	}
+	if ((size_t)cnt != size) {
+		ERROR(disk, "short read or read error from block device");
+		goto fail;
+	}
+	if (p2 != data) {
+		memcpy(data, p2, size);
+		ufs_buf_free(disk, p2, size);
+	}
+	return (cnt);
+fail:	memset(data, 0, size);
+	if (p2 != data) {
+		ufs_buf_free(disk, p2, size);
+	}
+	return (-1);
+}
+
+static ssize_t
+pread_write(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
+	ssize_t cnt;
+	void *p2 = NULL;
+
+	ERROR(disk, NULL);
+
+	/*
+	 * XXX: various disk controllers require alignment of our buffer
+	 * XXX: which is stricter than struct alignment, and O_DIRECT
+	 * XXX: needs sector alignment.
+	 * XXX: Bounce the buffer if not aligned to d_align.
+	 */
+	if (((intptr_t)data) & (disk->d_align - 1)) {
+		p2 = ufs_buf_alloc(disk, size);
+		if (p2 == NULL) {
+			ERROR(disk, "allocate bounce buffer");
+			return (-1);
+		}
+		memcpy(p2, data, size);
+		data = p2;
+	}
+	cnt = pwrite(disk->d_fd, data, size, off);
+	if (p2 != NULL)
+		ufs_buf_free(disk, p2, size);
+	if (cnt == -1) {
+		ERROR(disk, "write error to block device");
+		return (-1);
+	}
+	if ((size_t)cnt != size) {
+		ERROR(disk, "short write to block device");
+		return (-1);
+	}
+
+	return (cnt);
+}
+
+static size_t
+iov_total(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return (total);
+}
+
+/*
+ * Vectored I/O cannot bounce, so misaligned vectors go one by one.
+ */
+static int
+iov_aligned(struct uufsd *disk, const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if (((intptr_t)iov[i].iov_base | iov[i].iov_len) &
+		    (disk->d_align - 1))
+			return (0);
+	return (1);
+}
+
+static ssize_t
+pread_readv(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	ssize_t cnt;
+	int i;
+
+	ERROR(disk, NULL);
+
+	if (!iov_aligned(disk, iov, iovcnt)) {
+		for (cnt = 0, i = 0; i < iovcnt; i++) {
+			if (pread_read(disk, off + cnt, iov[i].iov_base,
+			    iov[i].iov_len) == -1)
+				return (-1);
+			cnt += iov[i].iov_len;
+		}
+		return (cnt);
+	}
+
+	cnt = preadv(disk->d_fd, iov, iovcnt, off);
+	if (cnt == -1) {
+		ERROR(disk, "read error from block device");
+		goto fail;
+	}
+	if ((size_t)cnt != iov_total(iov, iovcnt)) {
+		ERROR(disk, "short read or read error from block device");
+		goto fail;
+	}
+	return (cnt);
+fail:	for (i = 0; i < iovcnt; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+	return (-1);
+}
+
+static ssize_t
+pread_writev(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	ssize_t cnt;
+	int i;
+
+	ERROR(disk, NULL);
+
+	if (!iov_aligned(disk, iov, iovcnt)) {
+		for (cnt = 0, i = 0; i < iovcnt; i++) {
+			if (pread_write(disk, off + cnt, iov[i].iov_base,
+			    iov[i].iov_len) == -1)
+				return (-1);
+			cnt += iov[i].iov_len;
+		}
+		return (cnt);
+	}
+
+	cnt = pwritev(disk->d_fd, iov, iovcnt, off);
+	if (cnt == -1) {
+		ERROR(disk, "write error to block device");
+		return (-1);
+	}
+	if ((size_t)cnt != iov_total(iov, iovcnt)) {
+		ERROR(disk, "short write to block device");
+		return (-1);
+	}
+	return (cnt);
+}
+
+static int
+pread_flush(struct uufsd *disk)
+{
+	ERROR(disk, NULL);
+
+	if (fsync(disk->d_fd) == -1 && errno != EINVAL) {
+		ERROR(disk, "failed to flush block device");
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+pread_discard(struct uufsd *disk, off_t off, off_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	/* Only image files can punch holes; devices just ignore it. */
+	if (fallocate(disk->d_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    off, len) == -1 && errno != EOPNOTSUPP && errno != ENODEV)
+		return (-1);
+#endif
+	return (0);
+}
+
+static void
+pread_prefetch(struct uufsd *disk, off_t off, size_t size)
+{
+	(void)posix_fadvise(disk->d_fd, off, (off_t)size, POSIX_FADV_WILLNEED);
+}
+
+const struct ufs_backend ufs_pread_backend = {
+	.ub_name	= "pread",
+	.ub_read	= pread_read,
+	.ub_write	= pread_write,
+	.ub_readv	= pread_readv,
+	.ub_writev	= pread_writev,
+	.ub_flush	= pread_flush,
+	.ub_discard	= pread_discard,
+	.ub_prefetch	= pread_prefetch,
+};
+
+static const struct ufs_backend *backends[] = {
+	&ufs_pread_backend,
+	&ufs_uring_backend,
+	&ufs_mapped_backend,
+	&ufs_ram_backend,
+	&ufs_slow_backend,
+	NULL
+};
+
+const struct ufs_backend *
+ufs_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; backends[i] != NULL; i++)
+		if (strcmp(backends[i]->ub_name, name) == 0)
+			return (backends[i]);
+	return (NULL);
+}
+
+/*
+ * Look up a numeric "key=value" setting in backend args, which are
+ * separated by ':'.  Returns def when the key is not there.
+ */
+long
+ufs_backend_optnum(const char *args, const char *key, long def)
+{
+	size_t klen = strlen(key);
+
+	while (args != NULL && *args != '\0') {
+		if (strncmp(args, key, klen) == 0 && args[klen] == '=')
+			return (strtol(args + klen + 1, NULL, 0));
+		args = strchr(args, ':');
+		if (args != NULL)
+			args++;
+	}
+	return (def);
+}
+
+/*
+ * Switch disk over to the backend described by spec.  On failure the
+ * disk is left on the default backend.
+ */
+int
+ufs_disk_backend(struct uufsd *disk, const char *spec)
+{
+	const struct ufs_backend *bk;
+	const char *args;
+	char name[32];
+	size_t len;
+
+	ERROR(disk, NULL);
+
+	args = strchr(spec, ':');
+	len = args != NULL ? (size_t)(args - spec) : strlen(spec);
+	if (len >= sizeof(name)) {
+		ERROR(disk, "unknown I/O backend");
+		return (-1);
+	}
+	memcpy(name, spec, len);
+	name[len] = '\0';
+	args = args != NULL ? args + 1 : "";
+
+	bk = ufs_backend_find(name);
+	if (bk == NULL) {
+		ERROR(disk, "unknown I/O backend");
+		return (-1);
+	}
+	if (bk == disk->d_backend)
+		return (0);
+
+	/* Whatever the old backend holds must reach the device first. */
+	if (ufs_disk_sync(disk) == -1)
+		return (-1);
+	if (bk->ub_flags & UB_NOCACHE)
+		bcache_destroy(disk);
+	if (disk->d_backend->ub_close != NULL)
+		disk->d_backend->ub_close(disk);
+	disk->d_backend = &ufs_pread_backend;
+	disk->d_bkdata = NULL;
+
+	if (bk->ub_open != NULL && bk->ub_open(disk, args) == -1)
+		return (-1);
+	disk->d_backend = bk;
+	return (0);
+}
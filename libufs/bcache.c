@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Write-back block cache underneath bread()/bwrite().
+ *
+ * Buffers are keyed by their byte offset and length on the device.
+ * Callers do not always use the same length for a given address (the
+ * tail of a file grows a fragment at a time, directories are read in
+ * pieces), so buffers may overlap.  Every overlapping buffer is kept
+ * coherent: a write is copied into all buffers it touches, and data
+ * fresh from the device is patched with whatever the cache holds,
+ * since that may be newer than the device.
+ *
+ * Dirty buffers are never written back one at a time when it can be
+ * helped: a flush, or an eviction that hits a dirty buffer, collects
+ * the dirty buffers, sorts them by address and submits them as one
+ * batch, in which adjacent buffers are merged into vectored writes.
+ *
+ * Backends flagged UB_NOCACHE already keep the whole device in memory;
+ * the cache stays disabled on top of them.
+ *
+ * Buffers are hashed on the BC_CHUNK sized piece of the device they
+ * start in.  No buffer is larger than a chunk, so every buffer that
+ * overlaps a range starts either in one of the chunks covering the
+ * range or in the chunk just before it.  Larger requests bypass the
+ * cache but are still kept coherent with it.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libufs.h>
+
+#define	BC_CHUNK	MAXBSIZE	/* hash granularity and largest buffer */
+#define	BC_AVGBUF	16384		/* expected buffer size, sizes the hash */
+#define	BC_MINHASH	64		/* minimum number of hash buckets */
+#define	BC_CLUSTER	8		/* evicting writes back 1/8 of the cache */
+
+#define	B_DIRTY		0x01		/* buffer is newer than the device */
+
+struct bcbuf {
+	LIST_ENTRY(bcbuf) b_hash;	/* hash chain */
+	TAILQ_ENTRY(bcbuf) b_lru;	/* LRU list, most recent first */
+	off_t	b_off;			/* byte offset on the device */
+	size_t	b_size;			/* length of b_data */
+	int	b_flags;		/* B_* flags */
+	char	*b_data;		/* cached contents */
+};
+
+LIST_HEAD(bchead, bcbuf);
+TAILQ_HEAD(bclru, bcbuf);
+
+struct bcache {
+	struct bchead *bc_hash;		/* hash buckets */
+	u_long	bc_hashmask;		/* number of buckets - 1 */
+	struct bclru bc_lru;		/* all buffers, most recent first */
+	struct bcache_stats bc_stats;	/* counters, byte accounting */
+};
+
+static inline struct bchead *
+bc_bucket(struct bcache *bc, off_t chunk)
+{
+	return (&bc->bc_hash[(u_long)chunk & bc->bc_hashmask]);
+}
+
+static struct bcbuf *
+bc_lookup(struct bcache *bc, off_t off, size_t size)
+{
+	struct bcbuf *bp;
+
+	LIST_FOREACH(bp, bc_bucket(bc, off / BC_CHUNK), b_hash)
+		if (bp->b_off == off && bp->b_size == size)
+			return (bp);
+	return (NULL);
+}
+
+static struct bcbuf *
+bc_alloc(struct uufsd *disk, off_t off, size_t size)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp;
+
+	bp = malloc(sizeof(*bp));
+	if (bp == NULL)
+		return (NULL);
+	bp->b_data = ufs_buf_alloc(disk, size);
+	if (bp->b_data == NULL) {
+		free(bp);
+		return (NULL);
+	}
+	bp->b_off = off;
+	bp->b_size = size;
+	bp->b_flags = 0;
+	LIST_INSERT_HEAD(bc_bucket(bc, off / BC_CHUNK), bp, b_hash);
+	TAILQ_INSERT_HEAD(&bc->bc_lru, bp, b_lru);
+	bc->bc_stats.bs_bytes += size;
+	return (bp);
+}
+
+static void
+bc_release(struct uufsd *disk, struct bcbuf *bp)
+{
+	struct bcache *bc = disk->d_cache;
+
+	LIST_REMOVE(bp, b_hash);
+	TAILQ_REMOVE(&bc->bc_lru, bp, b_lru);
+	bc->bc_stats.bs_bytes -= bp->b_size;
+	ufs_buf_free(disk, bp->b_data, bp->b_size);
+	free(bp);
+}
+
+static inline void
+bc_touch(struct bcache *bc, struct bcbuf *bp)
+{
+	TAILQ_REMOVE(&bc->bc_lru, bp, b_lru);
+	TAILQ_INSERT_HEAD(&bc->bc_lru, bp, b_lru);
+}
+
+/*
+ * Copy the overlapping parts of [off, off + size) between data and
+ * every cached buffer except skip.  With tobuf set the buffers are
+ * updated from data, otherwise data is patched from the buffers.
+ */
+static void
+bc_sync(struct bcache *bc, off_t off, char *data, size_t size,
+    struct bcbuf *skip, int tobuf)
+{
+	struct bcbuf *bp;
+	off_t chunk, first, last, start, end;
+
+	first = off / BC_CHUNK;
+	if (first > 0)
+		first--;
+	last = (off + (off_t)size - 1) / BC_CHUNK;
+	for (chunk = first; chunk <= last; chunk++) {
+		LIST_FOREACH(bp, bc_bucket(bc, chunk), b_hash) {
+			if (bp == skip || bp->b_off / BC_CHUNK != chunk)
+				continue;
+			start = bp->b_off > off ? bp->b_off : off;
+			end = bp->b_off + (off_t)bp->b_size;
+			if (end > off + (off_t)size)
+				end = off + (off_t)size;
+			if (start >= end)
+				continue;
+			if (tobuf)
+				memcpy(bp->b_data + (start - bp->b_off),
+				    data + (start - off), end - start);
+			else
+				memcpy(data + (start - off),
+				    bp->b_data + (start - bp->b_off), end - start);
+		}
+	}
+}
+
+static int
+bc_writeback(struct uufsd *disk, struct bcbuf *bp)
+{
+	if ((bp->b_flags & B_DIRTY) == 0)
+		return (0);
+	if (pbwrite(disk, bp->b_off, bp->b_data, bp->b_size) == -1)
+		return (-1);
+	bp->b_flags &= ~B_DIRTY;
+	disk->d_cache->bc_stats.bs_writebacks++;
+	return (0);
+}
+
+static int
+bc_cmp(const void *a, const void *b)
+{
+	const struct bcbuf *x = *(struct bcbuf * const *)a;
+	const struct bcbuf *y = *(struct bcbuf * const *)b;
+
+	if (x->b_off != y->b_off)
+		return (x->b_off < y->b_off ? -1 : 1);
+	return (x->b_size < y->b_size ? -1 : x->b_size > y->b_size);
+}
+
+/*
+ * Write back the n dirty buffers in bps[] in ascending device order,
+ * elevator style, so the device sees a single sweep and pbsubmit()
+ * can merge adjacent buffers into one vectored write.
+ */
+static int
+bc_writelist(struct uufsd *disk, struct bcbuf **bps, int n)
+{
+	struct ufs_io *io;
+	int i, error;
+
+	if (n == 0)
+		return (0);
+	io = malloc(n * sizeof(*io));
+	if (io == NULL) {
+		for (error = 0, i = 0; i < n; i++)
+			if (bc_writeback(disk, bps[i]) == -1)
+				error = -1;
+		return (error);
+	}
+	qsort(bps, n, sizeof(*bps), bc_cmp);
+	for (i = 0; i < n; i++) {
+		io[i].io_blkno = bps[i]->b_off / disk->d_bsize;
+		io[i].io_off = bps[i]->b_off;
+		io[i].io_data = bps[i]->b_data;
+		io[i].io_size = bps[i]->b_size;
+	}
+	error = pbsubmit(disk, io, n, 1);
+	if (error == 0) {
+		for (i = 0; i < n; i++)
+			bps[i]->b_flags &= ~B_DIRTY;
+		disk->d_cache->bc_stats.bs_writebacks += n;
+	}
+	free(io);
+	return (error);
+}
+
+/*
+ * Write back the dirty buffers among the least recently used ones,
+ * up to 1/BC_CLUSTER of the budget, so that evicting a dirty buffer
+ * costs one sorted sweep rather than a stream of random writes.
+ */
+static void
+bc_cluster(struct uufsd *disk)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp, **bps;
+	size_t bytes;
+	int n;
+
+	for (n = 0, bytes = 0, bp = TAILQ_LAST(&bc->bc_lru, bclru);
+	    bp != NULL && bytes < bc->bc_stats.bs_limit / BC_CLUSTER;
+	    bp = TAILQ_PREV(bp, bclru, b_lru)) {
+		bytes += bp->b_size;
+		if (bp->b_flags & B_DIRTY)
+			n++;
+	}
+	if (n < 2 || (bps = malloc(n * sizeof(*bps))) == NULL)
+		return;
+	for (n = 0, bytes = 0, bp = TAILQ_LAST(&bc->bc_lru, bclru);
+	    bp != NULL && bytes < bc->bc_stats.bs_limit / BC_CLUSTER;
+	    bp = TAILQ_PREV(bp, bclru, b_lru)) {
+		bytes += bp->b_size;
+		if (bp->b_flags & B_DIRTY)
+			bps[n++] = bp;
+	}
+	/* On failure the buffers stay dirty and are retried one by one. */
+	bc_writelist(disk, bps, n);
+	free(bps);
+}
+
+/*
+ * Evict least recently used buffers until the cache is back within
+ * its budget.  A dirty buffer that cannot be written back stays
+ * cached, so nothing is lost; the error is left in d_error.
+ */
+static void
+bc_trim(struct uufsd *disk, struct bcbuf *keep)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp, *prev;
+
+	bp = TAILQ_LAST(&bc->bc_lru, bclru);
+	while (bp != NULL && bc->bc_stats.bs_bytes > bc->bc_stats.bs_limit) {
+		prev = TAILQ_PREV(bp, bclru, b_lru);
+		if (bp != keep && (bp->b_flags & B_DIRTY))
+			bc_cluster(disk);
+		if (bp != keep && bc_writeback(disk, bp) == 0) {
+			bc_release(disk, bp);
+			bc->bc_stats.bs_evictions++;
+		}
+		bp = prev;
+	}
+}
+
+int
+bcache_init(struct uufsd *disk, size_t limit)
+{
+	struct bcache *bc;
+	u_long i, nhash;
+
+	ERROR(disk, NULL);
+
+	if (disk->d_cache != NULL) {
+		disk->d_cache->bc_stats.bs_limit = limit;
+		bc_trim(disk, NULL);
+		return (0);
+	}
+	if (limit == 0 || (disk->d_backend->ub_flags & UB_NOCACHE))
+		return (0);
+
+	for (nhash = BC_MINHASH; nhash < limit / BC_AVGBUF; nhash <<= 1)
+		;
+	bc = calloc(1, sizeof(*bc));
+	if (bc == NULL) {
+		ERROR(disk, "unable to allocate block cache");
+		return (-1);
+	}
+	bc->bc_hash = malloc(nhash * sizeof(*bc->bc_hash));
+	if (bc->bc_hash == NULL) {
+		free(bc);
+		ERROR(disk, "unable to allocate block cache");
+		return (-1);
+	}
+	for (i = 0; i < nhash; i++)
+		LIST_INIT(&bc->bc_hash[i]);
+	bc->bc_hashmask = nhash - 1;
+	TAILQ_INIT(&bc->bc_lru);
+	bc->bc_stats.bs_limit = limit;
+	disk->d_cache = bc;
+	return (0);
+}
+
+/*
+ * Throw the cache away.  Dirty buffers are lost; call bcache_flush()
+ * first to keep them.
+ */
+void
+bcache_destroy(struct uufsd *disk)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp;
+
+	if (bc == NULL)
+		return;
+	while ((bp = TAILQ_FIRST(&bc->bc_lru)) != NULL)
+		bc_release(disk, bp);
+	free(bc->bc_hash);
+	free(bc);
+	disk->d_cache = NULL;
+}
+
+/*
+ * Write every dirty buffer back to the device, sorted by address.
+ */
+int
+bcache_flush(struct uufsd *disk)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp, **bps;
+	int n, error = 0;
+
+	ERROR(disk, NULL);
+
+	if (bc == NULL)
+		return (0);
+	n = 0;
+	TAILQ_FOREACH(bp, &bc->bc_lru, b_lru)
+		if (bp->b_flags & B_DIRTY)
+			n++;
+	if (n == 0)
+		return (0);
+	bps = malloc(n * sizeof(*bps));
+	if (bps == NULL) {
+		TAILQ_FOREACH(bp, &bc->bc_lru, b_lru)
+			if (bc_writeback(disk, bp) == -1)
+				error = -1;
+		return (error);
+	}
+	n = 0;
+	TAILQ_FOREACH(bp, &bc->bc_lru, b_lru)
+		if (bp->b_flags & B_DIRTY)
+			bps[n++] = bp;
+	error = bc_writelist(disk, bps, n);
+	free(bps);
+	return (error);
+}
+
+/*
+ * Forget cached buffers lying entirely within [off, off + size),
+ * dirty or not.  Buffers only partly covered are kept.
+ */
+void
+bcache_invalidate(struct uufsd *disk, off_t off, size_t size)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp, *next;
+	off_t chunk, last;
+
+	if (bc == NULL || size == 0)
+		return;
+	last = (off + (off_t)size - 1) / BC_CHUNK;
+	for (chunk = off / BC_CHUNK; chunk <= last; chunk++) {
+		for (bp = LIST_FIRST(bc_bucket(bc, chunk)); bp != NULL; bp = next) {
+			next = LIST_NEXT(bp, b_hash);
+			if (bp->b_off >= off &&
+			    bp->b_off + (off_t)bp->b_size <= off + (off_t)size)
+				bc_release(disk, bp);
+		}
+	}
+}
+
+/*
+ * Copy the cached contents of [off, off + size) to data if the cache
+ * holds that exact buffer.  Returns 1 on a hit, 0 otherwise.
+ */
+int
+bcache_peek(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp;
+
+	if (bc == NULL)
+		return (0);
+	bp = bc_lookup(bc, off, size);
+	if (bp == NULL) {
+		bc->bc_stats.bs_misses++;
+		return (0);
+	}
+	bc->bc_stats.bs_hits++;
+	bc_touch(bc, bp);
+	memcpy(data, bp->b_data, size);
+	return (1);
+}
+
+/*
+ * Enter size bytes just read from the device at off into the cache.
+ * data is first patched with anything newer that overlapping buffers
+ * hold, so the caller sees the same thing a cache hit would give.
+ */
+void
+bcache_fill(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp = NULL;
+
+	if (bc == NULL)
+		return;
+	bc_sync(bc, off, data, size, NULL, 0);
+	if (size <= BC_CHUNK && bc_lookup(bc, off, size) == NULL)
+		bp = bc_alloc(disk, off, size);
+	if (bp == NULL)
+		return;
+	memcpy(bp->b_data, data, size);
+	bc_trim(disk, bp);
+}
+
+/*
+ * Read the elements of io[] that the cache does not hold yet straight
+ * into new cache buffers, all in one batch.  io_off and io_size must
+ * be set, io_data is ignored.  Nothing is cached if the read fails.
+ */
+int
+bcache_prefetch(struct uufsd *disk, struct ufs_io *io, int nio)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf **bps;
+	struct ufs_io *miss;
+	int i, n, error;
+
+	ERROR(disk, NULL);
+
+	miss = malloc(nio * sizeof(*miss));
+	bps = malloc(nio * sizeof(*bps));
+	if (miss == NULL || bps == NULL) {
+		free(miss);
+		free(bps);
+		return (0);
+	}
+	for (n = 0, i = 0; i < nio; i++) {
+		if (io[i].io_size > BC_CHUNK ||
+		    bc_lookup(bc, io[i].io_off, io[i].io_size) != NULL)
+			continue;
+		bps[n] = bc_alloc(disk, io[i].io_off, io[i].io_size);
+		if (bps[n] == NULL)
+			break;
+		miss[n] = io[i];
+		miss[n].io_data = bps[n]->b_data;
+		n++;
+	}
+	error = pbsubmit(disk, miss, n, 0);
+	for (i = 0; i < n; i++) {
+		if (error) {
+			bc_release(disk, bps[i]);
+			continue;
+		}
+		/* Overlapping buffers may hold newer data. */
+		bc_sync(bc, bps[i]->b_off, bps[i]->b_data, bps[i]->b_size,
+		    bps[i], 0);
+	}
+	if (error == 0) {
+		bc->bc_stats.bs_prefetches += n;
+		bc_trim(disk, NULL);
+	}
+	free(miss);
+	free(bps);
+	return (error);
+}
+
+ssize_t
+bcache_read(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	ERROR(disk, NULL);
+
+	if (bcache_peek(disk, off, data, size))
+		return (size);
+	if (pbread(disk, off, data, size) == -1)
+		return (-1);
+	bcache_fill(disk, off, data, size);
+	return (size);
+}
+
+ssize_t
+bcache_write(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
+	struct bcache *bc = disk->d_cache;
+	struct bcbuf *bp;
+
+	ERROR(disk, NULL);
+
+	bc->bc_stats.bs_writes++;
+	bp = bc_lookup(bc, off, size);
+	if (bp == NULL && size <= BC_CHUNK)
+		bp = bc_alloc(disk, off, size);
+	if (bp == NULL) {
+		/* Too large to cache, or out of memory: write through. */
+		if (pbwrite(disk, off, data, size) == -1)
+			return (-1);
+		bc_sync(bc, off, (char *)(uintptr_t)data, size, NULL, 1);
+		return (size);
+	}
+	memcpy(bp->b_data, data, size);
+	bp->b_flags |= B_DIRTY;
+	bc_touch(bc, bp);
+	bc_sync(bc, off, bp->b_data, size, bp, 1);
+	bc_trim(disk, bp);
+	return (size);
+}
+
+void
+bcache_stats(struct uufsd *disk, struct bcache_stats *stats)
+{
+	if (disk->d_cache == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	*stats = disk->d_cache->bc_stats;
+}
@@ -31,6 +31,7 @@
 #include <sys/mount.h>
 #include <sys/disklabel.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <ufsmount.h>
 #include <dinode.h>
@@ -45,57 +46,221 @@
 
 #include <libufs.h>
 
+/*
+ * Read size bytes at byte offset off straight from the backend,
+ * bypassing the block cache.
+ */
 ssize_t
-bread(struct uufsd *disk, ufs2_daddr_t blockno, void *data, size_t size)
+pbread(struct uufsd *disk, off_t off, void *data, size_t size)
 {
-	void *p2;
-	ssize_t cnt;
+	ERROR(disk, NULL);
+
+	return (disk->d_backend->ub_read(disk, off, data, size));
+}
 
+/*
+ * Write size bytes at byte offset off straight to the backend,
+ * bypassing the block cache.
+ */
+ssize_t
+pbwrite(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
 	ERROR(disk, NULL);
 
-	p2 = data;
-	/*
-	 * XXX: various disk controllers require alignment of our buffer
-	 * XXX: which is stricter than struct alignment.
-	 * XXX: Bounce the buffer if not 64 byte aligned.
-	 * XXX: this can be removed if/when the kernel is fixed
-	 */
-	if (((intptr_t)data) & 0x3f) {
-		p2 = malloc(size);
-		if (p2 == NULL)
-			ERROR(disk, "allocate bounce buffer");
+	if (disk->d_backend->ub_write == NULL) {
+		errno = EROFS;
+		ERROR(disk, "backend does not support writing");
+		return (-1);
 	}
-	cnt = pread(disk->d_fd, p2, size, (off_t)(blockno * disk->d_bsize));
-	if (cnt == -1) {
-		ERROR(disk, "read error from block device");
-		goto fail;
+	return (disk->d_backend->ub_write(disk, off, data, size));
+}
+
+/*
+ * Scatter/gather variants of pbread()/pbwrite().  Backends without
+ * vectored I/O get one call per iovec.
+ */
+ssize_t
+pbreadv(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	ssize_t cnt, total;
+	int i;
+
+	ERROR(disk, NULL);
+
+	if (disk->d_backend->ub_readv != NULL)
+		return (disk->d_backend->ub_readv(disk, off, iov, iovcnt));
+	for (total = 0, i = 0; i < iovcnt; i++) {
+		cnt = pbread(disk, off + total, iov[i].iov_base, iov[i].iov_len);
+		if (cnt == -1)
+			return (-1);
+		total += cnt;
 	}
-	if (cnt == 0) {
-		ERROR(disk, "end of file from block device");
-		goto fail;
+	return (total);
+}
+
+ssize_t
+pbwritev(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	ssize_t cnt, total;
+	int i;
+
+	ERROR(disk, NULL);
+
+	if (disk->d_backend->ub_writev != NULL)
+		return (disk->d_backend->ub_writev(disk, off, iov, iovcnt));
+	for (total = 0, i = 0; i < iovcnt; i++) {
+		cnt = pbwrite(disk, off + total, iov[i].iov_base, iov[i].iov_len);
+		if (cnt == -1)
+			return (-1);
+		total += cnt;
 	}
-	if ((size_t)cnt != size) {
-		ERROR(disk, "short read or read error from block device");
-		goto fail;
+	return (total);
+}
+
+/*
+ * Count how many elements at the start of io[] cover one contiguous
+ * byte range of the device, at most max.
+ */
+int
+ufs_io_contig(const struct ufs_io *io, int nio, int max)
+{
+	int n;
+
+	for (n = 1; n < nio && n < max; n++)
+		if (io[n - 1].io_off + (off_t)io[n - 1].io_size !=
+		    io[n].io_off)
+			break;
+	return (n);
+}
+
+/*
+ * Hand a list of reads (or writes) straight to the backend.  Backends
+ * that cannot batch get them one contiguous run at a time, each run
+ * as a single vectored call.
+ */
+int
+pbsubmit(struct uufsd *disk, struct ufs_io *io, int nio, int write)
+{
+	struct iovec iov[UFS_IO_MAXRUN];
+	ssize_t cnt;
+	int i, j, n;
+
+	ERROR(disk, NULL);
+
+	if (nio == 0)
+		return (0);
+	if (disk->d_backend->ub_submit != NULL)
+		return (disk->d_backend->ub_submit(disk, io, nio, write));
+	for (i = 0; i < nio; i += n) {
+		n = ufs_io_contig(io + i, nio - i, UFS_IO_MAXRUN);
+		if (n == 1) {
+			if (write)
+				cnt = pbwrite(disk, io[i].io_off,
+				    io[i].io_data, io[i].io_size);
+			else
+				cnt = pbread(disk, io[i].io_off,
+				    io[i].io_data, io[i].io_size);
+		} else {
+			for (j = 0; j < n; j++) {
+				iov[j].iov_base = io[i + j].io_data;
+				iov[j].iov_len = io[i + j].io_size;
+			}
+			if (write)
+				cnt = pbwritev(disk, io[i].io_off, iov, n);
+			else
+				cnt = pbreadv(disk, io[i].io_off, iov, n);
+		}
+		if (cnt == -1)
+			return (-1);
 	}
-	if (p2 != data) {
-		memcpy(data, p2, size);
-		free(p2);
+	return (0);
+}
+
+/*
+ * Read a list of blocks in one go.  Blocks the cache holds are copied
+ * out right away and the rest are passed to the backend together, so
+ * that it can keep all of them in flight at once.
+ */
+int
+bread_batch(struct uufsd *disk, struct ufs_io *io, int nio)
+{
+	struct ufs_io *miss;
+	int i, nmiss, error;
+
+	ERROR(disk, NULL);
+
+	for (i = 0; i < nio; i++)
+		io[i].io_off = (off_t)io[i].io_blkno * disk->d_bsize;
+	if (disk->d_cache == NULL)
+		return (pbsubmit(disk, io, nio, 0));
+
+	miss = malloc(nio * sizeof(*miss));
+	if (miss == NULL) {
+		for (i = 0; i < nio; i++)
+			if (bread(disk, io[i].io_blkno, io[i].io_data,
+			    io[i].io_size) == -1)
+				return (-1);
+		return (0);
+	}
+	for (nmiss = 0, i = 0; i < nio; i++)
+		if (!bcache_peek(disk, io[i].io_off, io[i].io_data,
+		    io[i].io_size))
+			miss[nmiss++] = io[i];
+	error = pbsubmit(disk, miss, nmiss, 0);
+	if (error == 0)
+		for (i = 0; i < nmiss; i++)
+			bcache_fill(disk, miss[i].io_off, miss[i].io_data,
+			    miss[i].io_size);
+	free(miss);
+	return (error);
+}
+
+/*
+ * Write a list of blocks in one go.  With the cache enabled the
+ * writes are simply absorbed by it.
+ */
+int
+bwrite_batch(struct uufsd *disk, struct ufs_io *io, int nio)
+{
+	int i;
+
+	ERROR(disk, NULL);
+
+	if (ufs_disk_write(disk) == -1) {
+		ERROR(disk, "failed to open disk for writing");
+		return (-1);
 	}
-	return (cnt);
-fail:	memset(data, 0, size);
-	if (p2 != data) {
-		free(p2);
+
+	for (i = 0; i < nio; i++) {
+		io[i].io_off = (off_t)io[i].io_blkno * disk->d_bsize;
+		inocache_sync(disk, io[i].io_off, io[i].io_data,
+		    io[i].io_size);
 	}
-	return (-1);
+	if (disk->d_cache == NULL)
+		return (pbsubmit(disk, io, nio, 1));
+	for (i = 0; i < nio; i++)
+		if (bcache_write(disk, io[i].io_off, io[i].io_data,
+		    io[i].io_size) == -1)
+			return (-1);
+	return (0);
+}
+
+ssize_t
+bread(struct uufsd *disk, ufs2_daddr_t blockno, void *data, size_t size)
+{
+	off_t off;
+
+	off = (off_t)blockno * disk->d_bsize;
+	if (disk->d_cache != NULL)
+		return (bcache_read(disk, off, data, size));
+	return (pbread(disk, off, data, size));
 }
 
 ssize_t
 bwrite(struct uufsd *disk, ufs2_daddr_t blockno, const void *data, size_t size)
 {
-	ssize_t cnt;
+	off_t off;
 	int rv;
-	void *p2 = NULL;
 
 	ERROR(disk, NULL);
 
@@ -105,30 +270,67 @@ bwrite(struct uufsd *disk, ufs2_daddr_t blockno, const void *data, size_t size)
 		return (-1);
 	}
 
-	/*
-	 * XXX: various disk controllers require alignment of our buffer
-	 * XXX: which is stricter than struct alignment.
-	 * XXX: Bounce the buffer if not 64 byte aligned.
-	 * XXX: this can be removed if/when the kernel is fixed
-	 */
-	if (((intptr_t)data) & 0x3f) {
-		p2 = malloc(size);
-		if (p2 == NULL)
-			ERROR(disk, "allocate bounce buffer");
-		memcpy(p2, data, size);
-		data = p2;
-	}
-	cnt = pwrite(disk->d_fd, data, size, (off_t)(blockno * disk->d_bsize));
-	if (p2 != NULL)
-		free(p2);
-	if (cnt == -1) {
-		ERROR(disk, "write error to block device");
-		return (-1);
-	}
-	if ((size_t)cnt != size) {
-		ERROR(disk, "short write to block device");
-		return (-1);
-	}
+	off = (off_t)blockno * disk->d_bsize;
+	inocache_sync(disk, off, data, size);
+	if (disk->d_cache != NULL)
+		return (bcache_write(disk, off, data, size));
+	return (pbwrite(disk, off, data, size));
+}
+
+/*
+ * Tell the backend that size bytes at blockno no longer hold data.
+ * Cached copies of the range are dropped without being written back.
+ */
+int
+bdiscard(struct uufsd *disk, ufs2_daddr_t blockno, size_t size)
+{
+	off_t off;
+
+	ERROR(disk, NULL);
+
+	off = (off_t)blockno * disk->d_bsize;
+	if (disk->d_cache != NULL)
+		bcache_invalidate(disk, off, size);
+	if (disk->d_backend->ub_discard == NULL)
+		return (0);
+	return (disk->d_backend->ub_discard(disk, off, (off_t)size));
+}
 
-	return (cnt);
+/*
+ * Hint that size bytes at blockno will be read soon.
+ */
+void
+bprefetch(struct uufsd *disk, ufs2_daddr_t blockno, size_t size)
+{
+	if (disk->d_backend->ub_prefetch != NULL)
+		disk->d_backend->ub_prefetch(disk,
+		    (off_t)blockno * disk->d_bsize, size);
+}
+
+/*
+ * Read a list of blocks ahead of use.  With the cache enabled they are
+ * loaded into it in one batch; otherwise each contiguous run is passed
+ * to the backend as a hint.  io_data is ignored.
+ */
+int
+bprefetch_batch(struct uufsd *disk, struct ufs_io *io, int nio)
+{
+	size_t size;
+	int i, j, n;
+
+	ERROR(disk, NULL);
+
+	for (i = 0; i < nio; i++)
+		io[i].io_off = (off_t)io[i].io_blkno * disk->d_bsize;
+	if (disk->d_cache != NULL)
+		return (bcache_prefetch(disk, io, nio));
+	if (disk->d_backend->ub_prefetch == NULL)
+		return (0);
+	for (i = 0; i < nio; i += n) {
+		n = ufs_io_contig(io + i, nio - i, nio - i);
+		for (size = 0, j = 0; j < n; j++)
+			size += io[i + j].io_size;
+		disk->d_backend->ub_prefetch(disk, io[i].io_off, size);
+	}
+	return (0);
 }
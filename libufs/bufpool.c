@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Pool of aligned I/O buffers.
+ *
+ * Every buffer is aligned to d_align, so it can be handed to the
+ * device even when it was opened with O_DIRECT.  Freed buffers are
+ * kept on per-size free lists (powers of two from BP_MINSIZE up to
+ * MAXBSIZE) for reuse, which also saves the malloc/free pair per
+ * block that the I/O paths used to pay.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libufs.h>
+
+#define	BP_MINSHIFT	9		/* smallest class, one sector */
+#define	BP_MINSIZE	(1 << BP_MINSHIFT)
+#define	BP_NCLASS	8		/* BP_MINSIZE .. MAXBSIZE */
+#define	BP_MAXFREE	32		/* buffers kept per class */
+
+struct bufpool {
+	void	*bp_free[BP_NCLASS];	/* free lists, linked through data */
+	int	bp_nfree[BP_NCLASS];	/* length of each free list */
+};
+
+/*
+ * Size class for size bytes, or -1 if it is too large to pool.
+ */
+static int
+bp_class(size_t size)
+{
+	int class;
+
+	for (class = 0; class < BP_NCLASS; class++)
+		if (size <= ((size_t)BP_MINSIZE << class))
+			return (class);
+	return (-1);
+}
+
+void *
+ufs_buf_alloc(struct uufsd *disk, size_t size)
+{
+	struct bufpool *bp = disk->d_pool;
+	void *buf;
+	int class;
+
+	class = bp_class(size);
+	if (class >= 0) {
+		if (bp != NULL && bp->bp_free[class] != NULL) {
+			buf = bp->bp_free[class];
+			bp->bp_free[class] = *(void **)buf;
+			bp->bp_nfree[class]--;
+			return (buf);
+		}
+		size = (size_t)BP_MINSIZE << class;
+	}
+	if (posix_memalign(&buf, MAX(disk->d_align, sizeof(void *)), size) != 0)
+		return (NULL);
+	return (buf);
+}
+
+void
+ufs_buf_free(struct uufsd *disk, void *buf, size_t size)
+{
+	struct bufpool *bp;
+	int class;
+
+	if (buf == NULL)
+		return;
+	class = bp_class(size);
+	if (class < 0) {
+		free(buf);
+		return;
+	}
+	if (disk->d_pool == NULL)
+		disk->d_pool = calloc(1, sizeof(struct bufpool));
+	bp = disk->d_pool;
+	if (bp == NULL || bp->bp_nfree[class] >= BP_MAXFREE) {
+		free(buf);
+		return;
+	}
+	*(void **)buf = bp->bp_free[class];
+	bp->bp_free[class] = buf;
+	bp->bp_nfree[class]++;
+}
+
+/*
+ * Release every pooled buffer.
+ */
+void
+ufs_buf_drain(struct uufsd *disk)
+{
+	struct bufpool *bp = disk->d_pool;
+	void *buf;
+	int class;
+
+	if (bp == NULL)
+		return;
+	for (class = 0; class < BP_NCLASS; class++) {
+		while ((buf = bp->bp_free[class]) != NULL) {
+			bp->bp_free[class] = *(void **)buf;
+			free(buf);
+		}
+	}
+	free(bp);
+	disk->d_pool = NULL;
+}
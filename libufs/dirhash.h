@@ -28,6 +28,8 @@
 #ifndef _UFS_UFS_DIRHASH_H_
 #define _UFS_UFS_DIRHASH_H_
 
+#include <stddef.h>
+
 /*
  * For fast operations on large directories, we maintain a hash
  * that maps the file name to the offset of the directory entry within
@@ -39,13 +41,16 @@
  * in a chain must be marked DIRHASH_DEL.
  *
  * We also maintain information about free space in each block
- * to speed up creations.
+ * to speed up creations.  Blocks are not compacted to make room for
+ * a new entry, so what is kept is the largest free run in each, the
+ * space a new entry could take in one piece.
  */
 #define DIRHASH_EMPTY	(-1)	/* entry unused */
 #define DIRHASH_DEL	(-2)	/* deleted entry; may be part of chain */
 
 #define DIRALIGN	4
-#define DH_NFSTATS	(DIRECTSIZ(MAXNAMLEN + 1) / DIRALIGN)
+#define DH_NFSTATS	((offsetof(struct direct, d_name) + MAXNAMLEN + 1 + \
+			    DIRALIGN - 1) / DIRALIGN)
 				 /* max DIRALIGN words in a directory entry */
 
 /*
@@ -79,49 +84,73 @@
 #define DH_ENTRY(dh, slot) \
     ((dh)->dh_hash[(slot) >> DH_BLKOFFSHIFT][(slot) & DH_BLKOFFMASK])
 
-struct dirhash {
-	struct mtx dh_mtx;	/* protects all fields except dh_list */
+/*
+ * Alongside the hash is a Bloom filter of the names, so that most
+ * lookups of a name that is not there end without reading any of the
+ * directory.  Removed names cannot be taken out of it; once they make
+ * up much of a filter that is filling up, the hash is dropped and
+ * built again from a fresh scan.
+ */
+#define DH_BLOOMK	4	/* filter bits set per name */
+#define DH_BLOOMBITS	8	/* filter bits per hash slot */
 
+struct dirhash {
 	doff_t	**dh_hash;	/* the hash array (2-level) */
 	int	dh_narrays;	/* number of entries in dh_hash */
 	int	dh_hlen;	/* total slots in the 2-level hash array */
 	int	dh_hused;	/* entries in use */
+	int	dh_nnames;	/* live names hashed */
+
+	u_int8_t *dh_bloom;	/* Bloom filter of the names */
+	u_int32_t dh_bloommask;	/* bits in the filter - 1 */
+	int	dh_bloomset;	/* bits set in it */
+	int	dh_bloomstale;	/* names removed since it was built */
 
 	/* Free space statistics. XXX assumes DIRBLKSIZ is 512. */
-	u_int8_t *dh_blkfree;	/* free DIRALIGN words in each dir block */
+	u_int8_t *dh_blkfree;	/* largest free run, in DIRALIGN words, per block */
 	int	dh_nblk;	/* size of dh_blkfree array */
 	int	dh_dirblks;	/* number of DIRBLKSIZ blocks in dir */
 	int	dh_firstfree[DH_NFSTATS + 1]; /* first blk with N words free */
 
-	int	dh_seqopt;	/* sequential access optimisation enabled */
-	doff_t	dh_seqoff;	/* sequential access optimisation offset */
-
 	int	dh_score;	/* access count for this dirhash */
 
 	int	dh_onlist;	/* true if on the ufsdirhash_list chain */
 
-	/* Protected by ufsdirhash_mtx. */
+	size_t	dh_memreqd;	/* memory charged to the dirhash budget */
+
 	TAILQ_ENTRY(dirhash) dh_list;	/* chain of all dirhashes */
 };
 
+struct dirhash_stats {
+	u_int64_t dhs_builds;	/* hashes built */
+	u_int64_t dhs_hits;	/* lookups that found the name */
+	u_int64_t dhs_misses;	/* lookups that proved the name absent */
+	u_int64_t dhs_recycles;	/* hashes dropped to stay within budget */
+	u_int64_t dhs_bloomneg;	/* misses the filter answered on its own */
+	u_int64_t dhs_bloomrebuilds; /* hashes dropped to renew the filter */
+	size_t	dhs_hashes;	/* hashes in memory */
+	size_t	dhs_mem;	/* memory held by them */
+	size_t	dhs_maxmem;	/* most memory they may hold */
+};
 
 /*
  * Dirhash functions.
+ *
+ * Unlike the kernel versions, which work on buffers, these take the
+ * name directly; the directory blocks are read through the inode's
+ * vnode.  ufsdirhash_lookup() returns 0 or ENOENT when the hash could
+ * answer, -1 when the directory has to be searched.
  */
-void	ufsdirhash_init(void);
-void	ufsdirhash_uninit(void);
+void	ufsdirhash_init(size_t);
 int	ufsdirhash_build(struct inode *);
-doff_t	ufsdirhash_findfree(struct inode *, int, int *);
-doff_t	ufsdirhash_enduseful(struct inode *);
-int	ufsdirhash_lookup(struct inode *, char *, int, doff_t *, struct buf **,
-	    doff_t *);
+int	ufsdirhash_lookup(struct inode *, const char *, int, doff_t *, ino_t *);
+doff_t	ufsdirhash_findfree(struct inode *, int);
+int	ufsdirhash_blkfree(const char *);
+void	ufsdirhash_setfree(struct inode *, doff_t, int);
 void	ufsdirhash_newblk(struct inode *, doff_t);
-void	ufsdirhash_add(struct inode *, struct direct *, doff_t);
-void	ufsdirhash_remove(struct inode *, struct direct *, doff_t);
-void	ufsdirhash_move(struct inode *, struct direct *, doff_t, doff_t);
-void	ufsdirhash_dirtrunc(struct inode *, doff_t);
+void	ufsdirhash_add(struct inode *, const char *, int, doff_t);
+void	ufsdirhash_remove(struct inode *, const char *, int, doff_t);
 void	ufsdirhash_free(struct inode *);
-
-void	ufsdirhash_checkblock(struct inode *, char *, doff_t);
+void	ufsdirhash_stats(struct dirhash_stats *);
 
 #endif /* !_UFS_UFS_DIRHASH_H_ */
@@ -25,12 +25,32 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Inode block cache.
+ *
+ * getino() hands out pointers into whole inode blocks, which are kept
+ * in a small LRU cache so that touching inodes spread over several
+ * blocks does not re-read a block on every call.  The pointer stays
+ * valid until the next getino(); putino() writes the block holding an
+ * inode back through bwrite().  Blocks are keyed by their byte offset
+ * on the device, so that bwrite() can keep cached copies up to date
+ * when someone else writes an inode block (see inocache_sync()).
+ *
+ * With a flush interval set, putino() only marks the block dirty.
+ * Dirty blocks are written back together, sorted by address, once the
+ * interval has passed since the last write-back (checked by putino()
+ * and inocache_tick(), there is no timer), on inocache_flush()
+ * (fsync, unmount) and when evicted; so any number of updates to the
+ * inodes of one block within an interval cost a single block write.
+ */
+
 #include <sys/cdefs.h>
 
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/disklabel.h>
 #include <sys/stat.h>
+#include <sys/queue.h>
 
 #include <ufsmount.h>
 #include <dinode.h>
@@ -41,15 +61,410 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libufs.h>
 
+struct inoblk {
+	LIST_ENTRY(inoblk) ib_hash;	/* hash chain */
+	TAILQ_ENTRY(inoblk) ib_lru;	/* LRU list, most recent first */
+	off_t	ib_off;			/* byte offset on the device */
+	caddr_t	ib_data;		/* fs_bsize bytes of inodes */
+	int	ib_dirty;		/* newer than the device */
+};
+
+LIST_HEAD(ibhead, inoblk);
+TAILQ_HEAD(iblru, inoblk);
+
+struct inocache {
+	struct ibhead *ic_hash;		/* hash buckets */
+	u_long	ic_hashmask;		/* number of buckets - 1 */
+	struct iblru ic_lru;		/* all blocks, most recent first */
+	int	ic_count;		/* blocks cached */
+	int	ic_limit;		/* most blocks cached */
+	long	ic_bsize;		/* size of every block */
+	int	ic_ndirty;		/* dirty blocks */
+	int	ic_interval;		/* seconds writes may be held back */
+	time_t	ic_flushed;		/* time of the last write-back */
+};
+
+static inline struct ibhead *
+ic_bucket(struct inocache *ic, off_t off)
+{
+	return (&ic->ic_hash[(u_long)(off / ic->ic_bsize) & ic->ic_hashmask]);
+}
+
+static struct inoblk *
+ic_lookup(struct inocache *ic, off_t off)
+{
+	struct inoblk *ib;
+
+	LIST_FOREACH(ib, ic_bucket(ic, off), ib_hash)
+		if (ib->ib_off == off)
+			return (ib);
+	return (NULL);
+}
+
+static void
+ic_release(struct uufsd *disk, struct inoblk *ib)
+{
+	struct inocache *ic = disk->d_inocache;
+
+	LIST_REMOVE(ib, ib_hash);
+	TAILQ_REMOVE(&ic->ic_lru, ib, ib_lru);
+	ic->ic_count--;
+	if (ib->ib_dirty)
+		ic->ic_ndirty--;
+	ufs_buf_free(disk, ib->ib_data, ic->ic_bsize);
+	free(ib);
+}
+
+static int
+ic_writeback(struct uufsd *disk, struct inoblk *ib)
+{
+	struct inocache *ic = disk->d_inocache;
+
+	if (!ib->ib_dirty)
+		return (0);
+	if (bwrite(disk, ib->ib_off / disk->d_bsize, ib->ib_data,
+	    ic->ic_bsize) == -1) {
+		ERROR(disk, "unable to write inode block");
+		return (-1);
+	}
+	ib->ib_dirty = 0;
+	ic->ic_ndirty--;
+	return (0);
+}
+
+static int
+ic_cmp(const void *a, const void *b)
+{
+	const struct inoblk *x = *(struct inoblk * const *)a;
+	const struct inoblk *y = *(struct inoblk * const *)b;
+
+	return (x->ib_off < y->ib_off ? -1 : x->ib_off > y->ib_off);
+}
+
+/*
+ * Set up the inode block cache to hold up to nblocks blocks, holding
+ * back inode writes for up to interval seconds (0 writes through).
+ * Any previous cache is written back and dropped.
+ */
+int
+inocache_init(struct uufsd *disk, int nblocks, int interval)
+{
+	struct inocache *ic;
+	u_long nbuckets;
+
+	ERROR(disk, NULL);
+
+	if (inocache_flush(disk) == -1)
+		return (-1);
+	inocache_destroy(disk);
+	if (nblocks < 1)
+		nblocks = 1;
+	ic = calloc(1, sizeof(*ic));
+	if (ic == NULL) {
+		ERROR(disk, "unable to allocate inode cache");
+		return (-1);
+	}
+	for (nbuckets = 1; nbuckets < (u_long)nblocks; nbuckets <<= 1)
+		;
+	ic->ic_hash = calloc(nbuckets, sizeof(*ic->ic_hash));
+	if (ic->ic_hash == NULL) {
+		free(ic);
+		ERROR(disk, "unable to allocate inode cache");
+		return (-1);
+	}
+	ic->ic_hashmask = nbuckets - 1;
+	TAILQ_INIT(&ic->ic_lru);
+	ic->ic_limit = nblocks;
+	ic->ic_bsize = disk->d_fs.fs_bsize;
+	ic->ic_interval = interval > 0 ? interval : 0;
+	ic->ic_flushed = time(NULL);
+	disk->d_inocache = ic;
+	return (0);
+}
+
+/*
+ * Write back every dirty inode block, in ascending device order and
+ * as one batch.
+ */
+int
+inocache_flush(struct uufsd *disk)
+{
+	struct inocache *ic = disk->d_inocache;
+	struct inoblk *ib, **ibs;
+	struct ufs_io *io;
+	int i, n, error;
+
+	ERROR(disk, NULL);
+
+	if (ic == NULL)
+		return (0);
+	ic->ic_flushed = time(NULL);
+	if (ic->ic_ndirty == 0)
+		return (0);
+	ibs = malloc(ic->ic_ndirty * sizeof(*ibs));
+	io = malloc(ic->ic_ndirty * sizeof(*io));
+	if (ibs == NULL || io == NULL) {
+		free(ibs);
+		free(io);
+		error = 0;
+		TAILQ_FOREACH(ib, &ic->ic_lru, ib_lru)
+			if (ic_writeback(disk, ib) == -1)
+				error = -1;
+		return (error);
+	}
+	n = 0;
+	TAILQ_FOREACH(ib, &ic->ic_lru, ib_lru)
+		if (ib->ib_dirty)
+			ibs[n++] = ib;
+	qsort(ibs, n, sizeof(*ibs), ic_cmp);
+	for (i = 0; i < n; i++) {
+		io[i].io_blkno = ibs[i]->ib_off / disk->d_bsize;
+		io[i].io_data = ibs[i]->ib_data;
+		io[i].io_size = ic->ic_bsize;
+	}
+	error = bwrite_batch(disk, io, n);
+	if (error == 0) {
+		for (i = 0; i < n; i++)
+			ibs[i]->ib_dirty = 0;
+		ic->ic_ndirty = 0;
+	} else
+		ERROR(disk, "unable to write inode blocks");
+	free(ibs);
+	free(io);
+	return (error);
+}
+
+/*
+ * Drop the cache.  Dirty blocks are lost, flush first.
+ */
+void
+inocache_destroy(struct uufsd *disk)
+{
+	struct inocache *ic = disk->d_inocache;
+	struct inoblk *ib;
+
+	if (ic == NULL)
+		return;
+	while ((ib = TAILQ_FIRST(&ic->ic_lru)) != NULL)
+		ic_release(disk, ib);
+	free(ic->ic_hash);
+	free(ic);
+	disk->d_inocache = NULL;
+}
+
+/*
+ * Bring cached inode blocks overlapping [off, off + size) up to date
+ * with data, which is about to be written there.
+ */
+void
+inocache_sync(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
+	struct inocache *ic = disk->d_inocache;
+	struct inoblk *ib;
+	off_t blk, start, end;
+
+	if (ic == NULL || ic->ic_count == 0 || size == 0)
+		return;
+	for (blk = off - off % ic->ic_bsize; blk < off + (off_t)size;
+	    blk += ic->ic_bsize) {
+		ib = ic_lookup(ic, blk);
+		if (ib == NULL || ib->ib_data == data)
+			continue;
+		start = MAX(blk, off);
+		end = MIN(blk + ic->ic_bsize, off + (off_t)size);
+		memcpy(ib->ib_data + (start - blk),
+		    (const char *)data + (start - off), end - start);
+	}
+}
+
+/*
+ * Take a block for a new cache entry, recycling the least recently
+ * used one when the cache is full.
+ */
+static struct inoblk *
+ic_alloc(struct uufsd *disk)
+{
+	struct inocache *ic = disk->d_inocache;
+	struct inoblk *ib;
+
+	if (ic->ic_count >= ic->ic_limit) {
+		ib = TAILQ_LAST(&ic->ic_lru, iblru);
+		if (ic_writeback(disk, ib) == -1)
+			return (NULL);
+		LIST_REMOVE(ib, ib_hash);
+		TAILQ_REMOVE(&ic->ic_lru, ib, ib_lru);
+		return (ib);
+	}
+	ib = malloc(sizeof(*ib));
+	if (ib == NULL) {
+		ERROR(disk, "unable to allocate inode block");
+		return (NULL);
+	}
+	ib->ib_data = ufs_buf_alloc(disk, ic->ic_bsize);
+	if (ib->ib_data == NULL) {
+		free(ib);
+		ERROR(disk, "unable to allocate inode block");
+		return (NULL);
+	}
+	ic->ic_count++;
+	return (ib);
+}
+
+/*
+ * Give back a block from ic_alloc() that could not be filled.
+ */
+static void
+ic_unalloc(struct uufsd *disk, struct inoblk *ib)
+{
+	struct inocache *ic = disk->d_inocache;
+
+	ic->ic_count--;
+	ufs_buf_free(disk, ib->ib_data, ic->ic_bsize);
+	free(ib);
+}
+
+static void
+ic_insert(struct inocache *ic, struct inoblk *ib, off_t off)
+{
+	ib->ib_off = off;
+	ib->ib_dirty = 0;
+	LIST_INSERT_HEAD(ic_bucket(ic, off), ib, ib_hash);
+	TAILQ_INSERT_HEAD(&ic->ic_lru, ib, ib_lru);
+}
+
+/*
+ * Find, or read in, the cached inode block holding inode.
+ */
+static struct inoblk *
+ic_get(struct uufsd *disk, ino_t inode)
+{
+	struct inocache *ic;
+	struct inoblk *ib;
+	struct fs *fs;
+	off_t off;
+
+	fs = &disk->d_fs;
+	if (disk->d_inocache == NULL &&
+	    inocache_init(disk, INOCACHE_DEFAULT, 0) == -1)
+		return (NULL);
+	ic = disk->d_inocache;
+
+	off = (off_t)fsbtodb(fs, ino_to_fsba(fs, inode)) * disk->d_bsize;
+	ib = ic_lookup(ic, off);
+	if (ib != NULL) {
+		TAILQ_REMOVE(&ic->ic_lru, ib, ib_lru);
+		TAILQ_INSERT_HEAD(&ic->ic_lru, ib, ib_lru);
+		return (ib);
+	}
+
+	ib = ic_alloc(disk);
+	if (ib == NULL)
+		return (NULL);
+	if (bread(disk, fsbtodb(fs, ino_to_fsba(fs, inode)), ib->ib_data,
+	    ic->ic_bsize) == -1) {
+		ic_unalloc(disk, ib);
+		ERROR(disk, "unable to read inode block");
+		return (NULL);
+	}
+	ic_insert(ic, ib, off);
+	return (ib);
+}
+
+static int
+io_cmp(const void *a, const void *b)
+{
+	const struct ufs_io *x = a;
+	const struct ufs_io *y = b;
+
+	return (x->io_blkno < y->io_blkno ? -1 : x->io_blkno > y->io_blkno);
+}
+
+/*
+ * Bring the inode blocks holding the n inodes listed into the cache,
+ * reading the ones it does not hold yet as a single batch.  Never
+ * reads more blocks than the cache holds, so that the first ones read
+ * are not recycled for the last.  Like getino(), this may recycle the
+ * block behind the last pointer getino() returned.
+ */
+int
+inocache_prefetch(struct uufsd *disk, const ino_t *inodes, int n)
+{
+	struct inocache *ic;
+	struct inoblk **ibs;
+	struct ufs_io *io;
+	struct fs *fs;
+	ufs2_daddr_t blkno;
+	int i, j, nio, error;
+
+	ERROR(disk, NULL);
+
+	fs = &disk->d_fs;
+	if (disk->d_inocache == NULL &&
+	    inocache_init(disk, INOCACHE_DEFAULT, 0) == -1)
+		return (-1);
+	ic = disk->d_inocache;
+	if (n <= 0)
+		return (0);
+
+	io = malloc(n * sizeof(*io));
+	ibs = malloc(n * sizeof(*ibs));
+	if (io == NULL || ibs == NULL) {
+		free(io);
+		free(ibs);
+		ERROR(disk, "unable to allocate inode prefetch");
+		return (-1);
+	}
+	for (nio = 0, i = 0; i < n && nio < ic->ic_limit; i++) {
+		if (inodes[i] < ROOTINO ||
+		    inodes[i] >= (ino_t)fs->fs_ncg * fs->fs_ipg)
+			continue;
+		blkno = fsbtodb(fs, ino_to_fsba(fs, inodes[i]));
+		if (ic_lookup(ic, (off_t)blkno * disk->d_bsize) != NULL)
+			continue;
+		for (j = 0; j < nio; j++)
+			if (io[j].io_blkno == blkno)
+				break;
+		if (j < nio)
+			continue;
+		io[nio].io_blkno = blkno;
+		io[nio].io_size = ic->ic_bsize;
+		nio++;
+	}
+	qsort(io, nio, sizeof(*io), io_cmp);
+
+	for (i = 0; i < nio; i++) {
+		ibs[i] = ic_alloc(disk);
+		if (ibs[i] == NULL)
+			break;
+		io[i].io_data = ibs[i]->ib_data;
+	}
+	nio = i;
+	error = bread_batch(disk, io, nio);
+	for (i = 0; i < nio; i++) {
+		if (error == 0)
+			ic_insert(ic, ibs[i], io[i].io_off);
+		else
+			ic_unalloc(disk, ibs[i]);
+	}
+	free(io);
+	free(ibs);
+	if (error) {
+		ERROR(disk, "unable to read inode blocks");
+		return (-1);
+	}
+	return (0);
+}
+
 int
 getino(struct uufsd *disk, void **dino, ino_t inode, int *mode)
 {
-	ino_t min, max;
-	caddr_t inoblock;
+	struct inoblk *ib;
+	ino_t min;
 	struct ufs1_dinode *dp1;
 	struct ufs2_dinode *dp2;
 	struct fs *fs;
@@ -57,34 +472,20 @@ getino(struct uufsd *disk, void **dino, ino_t inode, int *mode)
 	ERROR(disk, NULL);
 
 	fs = &disk->d_fs;
-	inoblock = disk->d_inoblock;
-	min = disk->d_inomin;
-	max = disk->d_inomax;
-
-	if (inoblock == NULL) {
-		inoblock = malloc(fs->fs_bsize);
-		if (inoblock == NULL) {
-			ERROR(disk, "unable to allocate inode block");
-			return (-1);
-		}
-		disk->d_inoblock = inoblock;
-	}
-	if (inode >= min && inode < max)
-		goto gotit;
-	bread(disk, fsbtodb(fs, ino_to_fsba(fs, inode)), inoblock,
-	    fs->fs_bsize);
-	disk->d_inomin = min = inode - (inode % INOPB(fs));
-	disk->d_inomax = max = min + INOPB(fs);
-gotit:	switch (disk->d_ufs) {
+	ib = ic_get(disk, inode);
+	if (ib == NULL)
+		return (-1);
+	min = inode - (inode % INOPB(fs));
+	switch (disk->d_ufs) {
 	case 1:
-		dp1 = &((struct ufs1_dinode *)inoblock)[inode - min];
+		dp1 = &((struct ufs1_dinode *)ib->ib_data)[inode - min];
 		if (mode) {
 			*mode = dp1->di_mode & IFMT;
 		}
 		*dino = dp1;
 		return (0);
 	case 2:
-		dp2 = &((struct ufs2_dinode *)inoblock)[inode - min];
+		dp2 = &((struct ufs2_dinode *)ib->ib_data)[inode - min];
 		if (mode) {
 			*mode = dp2->di_mode & IFMT;
 		}
@@ -96,3 +497,48 @@ gotit:	switch (disk->d_ufs) {
 	ERROR(disk, "unknown UFS filesystem type");
 	return (-1);
 }
+
+/*
+ * Write the inode block holding inode, as modified through the pointer
+ * getino() returned, back to the device; or, with a flush interval,
+ * just note that it needs writing.
+ */
+int
+putino(struct uufsd *disk, ino_t inode)
+{
+	struct inocache *ic;
+	struct inoblk *ib;
+
+	ERROR(disk, NULL);
+
+	ib = ic_get(disk, inode);
+	if (ib == NULL)
+		return (-1);
+	ic = disk->d_inocache;
+	if (!ib->ib_dirty) {
+		ib->ib_dirty = 1;
+		ic->ic_ndirty++;
+	}
+	if (ic->ic_interval == 0)
+		return (ic_writeback(disk, ib));
+	return (inocache_tick(disk));
+}
+
+/*
+ * Write back the dirty blocks if the flush interval has run out.
+ * putino() only gets to check when inodes keep changing, so callers
+ * also run this as other work comes in, to bound how long updates
+ * wait once the changes stop.
+ */
+int
+inocache_tick(struct uufsd *disk)
+{
+	struct inocache *ic = disk->d_inocache;
+
+	ERROR(disk, NULL);
+
+	if (ic == NULL || ic->ic_ndirty == 0 ||
+	    time(NULL) - ic->ic_flushed < ic->ic_interval)
+		return (0);
+	return (inocache_flush(disk));
+}
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * io_uring backend.
+ *
+ * Single reads and writes gain nothing from a ring and go through the
+ * pread backend.  Batches from bread_batch()/bwrite_batch() are queued
+ * up to the ring depth at a time and reaped together, so a request
+ * needing several blocks costs one system call instead of one per
+ * block.  The ring is driven with the raw system calls to avoid a
+ * dependency on liburing.
+ *
+ * When the kernel (or the headers we were built against) lacks
+ * io_uring, the backend quietly behaves like the pread one.
+ *
+ * Args: depth=N, the number of submission queue entries (default 32).
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libufs.h>
+
+#if HAVE_LINUX_IO_URING_H && HAVE_SYS_SYSCALL_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+#define	URING_ENABLED	1
+#endif
+
+#define	URING_DEFDEPTH	32
+#define	URING_MAXDEPTH	4096
+
+#ifdef URING_ENABLED
+
+struct uring {
+	int	ur_fd;			/* ring file descriptor */
+	unsigned ur_depth;		/* submission queue entries */
+	unsigned *ur_sqhead;		/* submission queue */
+	unsigned *ur_sqtail;
+	unsigned *ur_sqmask;
+	unsigned *ur_sqarray;
+	struct io_uring_sqe *ur_sqes;
+	unsigned *ur_cqhead;		/* completion queue */
+	unsigned *ur_cqtail;
+	unsigned *ur_cqmask;
+	struct io_uring_cqe *ur_cqes;
+	void	*ur_sqring;		/* mappings, for munmap */
+	size_t	ur_sqringsz;
+	void	*ur_cqring;
+	size_t	ur_cqringsz;
+	size_t	ur_sqessz;
+	struct iovec *ur_iov;		/* one iovec per element */
+};
+
+static void
+uring_free(struct uring *ur)
+{
+	if (ur->ur_sqes != NULL && ur->ur_sqes != MAP_FAILED)
+		munmap(ur->ur_sqes, ur->ur_sqessz);
+	if (ur->ur_cqring != NULL && ur->ur_cqring != MAP_FAILED)
+		munmap(ur->ur_cqring, ur->ur_cqringsz);
+	if (ur->ur_sqring != NULL && ur->ur_sqring != MAP_FAILED)
+		munmap(ur->ur_sqring, ur->ur_sqringsz);
+	if (ur->ur_fd >= 0)
+		close(ur->ur_fd);
+	free(ur->ur_iov);
+	free(ur);
+}
+
+static struct uring *
+uring_setup(unsigned depth)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	char *sq, *cq;
+
+	ur = calloc(1, sizeof(*ur));
+	if (ur == NULL)
+		return (NULL);
+	memset(&p, 0, sizeof(p));
+	ur->ur_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (ur->ur_fd < 0)
+		goto fail;
+
+	ur->ur_depth = p.sq_entries;
+	ur->ur_sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cqringsz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->ur_sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ur->ur_sqring = mmap(NULL, ur->ur_sqringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sqring == MAP_FAILED)
+		goto fail;
+	ur->ur_cqring = mmap(NULL, ur->ur_cqringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_CQ_RING);
+	if (ur->ur_cqring == MAP_FAILED)
+		goto fail;
+	ur->ur_sqes = mmap(NULL, ur->ur_sqessz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED)
+		goto fail;
+	ur->ur_iov = calloc(p.sq_entries, sizeof(*ur->ur_iov));
+	if (ur->ur_iov == NULL)
+		goto fail;
+
+	sq = ur->ur_sqring;
+	ur->ur_sqhead = (unsigned *)(sq + p.sq_off.head);
+	ur->ur_sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ur->ur_sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->ur_sqarray = (unsigned *)(sq + p.sq_off.array);
+	cq = ur->ur_cqring;
+	ur->ur_cqhead = (unsigned *)(cq + p.cq_off.head);
+	ur->ur_cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ur->ur_cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return (ur);
+fail:
+	uring_free(ur);
+	return (NULL);
+}
+
+/*
+ * Finish an element by hand, after a short transfer or when the ring
+ * had to be given up.
+ */
+static int
+uring_finish(struct uufsd *disk, struct ufs_io *io, size_t done, int write)
+{
+	ssize_t cnt;
+
+	if (done >= io->io_size)
+		return (0);
+	if (write)
+		cnt = ufs_pread_backend.ub_write(disk, io->io_off + done,
+		    (char *)io->io_data + done, io->io_size - done);
+	else
+		cnt = ufs_pread_backend.ub_read(disk, io->io_off + done,
+		    (char *)io->io_data + done, io->io_size - done);
+	return (cnt == -1 ? -1 : 0);
+}
+
+/*
+ * Queue up to one ring's worth of io and wait for all of it.  Elements
+ * that are contiguous on disk share one sqe, with an iovec each.
+ * Returns -1 with errno set if the ring itself failed.
+ */
+static int
+uring_run(struct uufsd *disk, struct uring *ur, struct ufs_io *io, int nio,
+    int write, int *error)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail, idx;
+	size_t res, done;
+	int i, j, n, nsqe, ret, unsubmitted, pending;
+
+	tail = *ur->ur_sqtail;
+	for (nsqe = 0, i = 0; i < nio; i += n) {
+		if (((intptr_t)io[i].io_data | io[i].io_size) &
+		    (disk->d_align - 1)) {
+			/* Needs a bounce buffer, which pread provides. */
+			if (uring_finish(disk, &io[i], 0, write) == -1)
+				*error = -1;
+			n = 1;
+			continue;
+		}
+		n = ufs_io_contig(io + i, nio - i, UFS_IO_MAXRUN);
+		for (j = 0; j < n; j++) {
+			if (((intptr_t)io[i + j].io_data | io[i + j].io_size) &
+			    (disk->d_align - 1))
+				break;
+			ur->ur_iov[i + j].iov_base = io[i + j].io_data;
+			ur->ur_iov[i + j].iov_len = io[i + j].io_size;
+		}
+		n = j;
+		idx = (tail + nsqe++) & *ur->ur_sqmask;
+		sqe = &ur->ur_sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = disk->d_fd;
+		sqe->off = io[i].io_off;
+		sqe->addr = (unsigned long)&ur->ur_iov[i];
+		sqe->len = n;
+		sqe->user_data = (__u64)i << 32 | n;
+		ur->ur_sqarray[idx] = idx;
+	}
+	__atomic_store_n(ur->ur_sqtail, tail + nsqe, __ATOMIC_RELEASE);
+
+	unsubmitted = pending = nsqe;
+	while (pending > 0) {
+		ret = syscall(__NR_io_uring_enter, ur->ur_fd, unsubmitted, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			return (-1);
+		}
+		unsubmitted -= MIN(ret, unsubmitted);
+
+		head = *ur->ur_cqhead;
+		while (head != __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &ur->ur_cqes[head & *ur->ur_cqmask];
+			i = (int)(cqe->user_data >> 32);
+			n = (int)(cqe->user_data & 0xffffffff);
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				*error = -1;
+			} else {
+				/* Spread the byte count over the run. */
+				res = cqe->res;
+				for (j = i; j < i + n; j++) {
+					done = MIN(res, io[j].io_size);
+					res -= done;
+					if (uring_finish(disk, &io[j], done,
+					    write) == -1)
+						*error = -1;
+				}
+			}
+			head++;
+			pending--;
+		}
+		__atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+	}
+	return (0);
+}
+
+static int
+uring_submit(struct uufsd *disk, struct ufs_io *io, int nio, int write)
+{
+	struct uring *ur = disk->d_bkdata;
+	int i, n, error = 0;
+
+	ERROR(disk, NULL);
+
+	for (i = 0; ur != NULL && i < nio; i += n) {
+		n = MIN((unsigned)(nio - i), ur->ur_depth);
+		if (uring_run(disk, ur, io + i, n, write, &error) == -1) {
+			/*
+			 * The ring is unusable; drop it and finish the
+			 * batch, and everything after it, synchronously.
+			 */
+			uring_free(ur);
+			disk->d_bkdata = ur = NULL;
+			break;
+		}
+	}
+	for (; i < nio; i++)
+		if (uring_finish(disk, &io[i], 0, write) == -1)
+			error = -1;
+	if (error && write)
+		ERROR(disk, "write error to block device");
+	else if (error)
+		ERROR(disk, "read error from block device");
+	return (error);
+}
+
+#endif	/* URING_ENABLED */
+
+static int
+uring_open(struct uufsd *disk, const char *args)
+{
+	long depth;
+
+	ERROR(disk, NULL);
+
+	depth = ufs_backend_optnum(args, "depth", URING_DEFDEPTH);
+	if (depth < 1 || depth > URING_MAXDEPTH) {
+		ERROR(disk, "invalid io_uring queue depth");
+		return (-1);
+	}
+#ifdef URING_ENABLED
+	/* No ring means we just fall back to pread(2). */
+	disk->d_bkdata = uring_setup((unsigned)depth);
+#endif
+	return (0);
+}
+
+static void
+uring_close(struct uufsd *disk)
+{
+#ifdef URING_ENABLED
+	if (disk->d_bkdata != NULL)
+		uring_free(disk->d_bkdata);
+#endif
+	disk->d_bkdata = NULL;
+}
+
+static ssize_t
+uring_read(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	return (ufs_pread_backend.ub_read(disk, off, data, size));
+}
+
+static ssize_t
+uring_write(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
+	return (ufs_pread_backend.ub_write(disk, off, data, size));
+}
+
+static ssize_t
+uring_readv(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	return (ufs_pread_backend.ub_readv(disk, off, iov, iovcnt));
+}
+
+static ssize_t
+uring_writev(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	return (ufs_pread_backend.ub_writev(disk, off, iov, iovcnt));
+}
+
+static int
+uring_flush(struct uufsd *disk)
+{
+	return (ufs_pread_backend.ub_flush(disk));
+}
+
+static int
+uring_discard(struct uufsd *disk, off_t off, off_t len)
+{
+	return (ufs_pread_backend.ub_discard(disk, off, len));
+}
+
+static void
+uring_prefetch(struct uufsd *disk, off_t off, size_t size)
+{
+	ufs_pread_backend.ub_prefetch(disk, off, size);
+}
+
+const struct ufs_backend ufs_uring_backend = {
+	.ub_name	= "uring",
+	.ub_open	= uring_open,
+	.ub_close	= uring_close,
+	.ub_read	= uring_read,
+	.ub_write	= uring_write,
+	.ub_readv	= uring_readv,
+	.ub_writev	= uring_writev,
+	.ub_flush	= uring_flush,
+	.ub_discard	= uring_discard,
+	.ub_prefetch	= uring_prefetch,
+#ifdef URING_ENABLED
+	.ub_submit	= uring_submit,
+#endif
+};
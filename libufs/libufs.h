@@ -64,6 +64,65 @@ do {								\
  * libufs structures.
  */
 
+struct bcache;
+struct bufpool;
+struct inocache;
+struct iovec;
+struct uufsd;
+
+/*
+ * One element of a batched request, see bread_batch().
+ */
+struct ufs_io {
+	ufs2_daddr_t io_blkno;	/* device block, as for bread() */
+	off_t	io_off;		/* byte offset, filled in by libufs */
+	void	*io_data;	/* buffer */
+	size_t	io_size;	/* length in bytes */
+};
+
+/*
+ * Most contiguous elements of a batch merged into one vectored request.
+ */
+#define	UFS_IO_MAXRUN	64
+
+/*
+ * Block device backend.  Every device access below the block cache
+ * goes through one of these; the default uses pread(2)/pwrite(2) on
+ * d_fd.  Offsets and sizes are in bytes.  Only ub_name and ub_read
+ * are mandatory, a backend without ub_write is read-only.
+ */
+struct ufs_backend {
+	const char *ub_name;
+	int	ub_flags;	/* UB_* flags */
+#define	UB_NOCACHE	0x01	/* data is already in memory, don't cache it */
+				/* attach, args is the text after "name:" */
+	int	(*ub_open)(struct uufsd *, const char *args);
+	void	(*ub_close)(struct uufsd *);
+	ssize_t	(*ub_read)(struct uufsd *, off_t, void *, size_t);
+	ssize_t	(*ub_write)(struct uufsd *, off_t, const void *, size_t);
+	ssize_t	(*ub_readv)(struct uufsd *, off_t, const struct iovec *, int);
+	ssize_t	(*ub_writev)(struct uufsd *, off_t, const struct iovec *, int);
+	int	(*ub_flush)(struct uufsd *);
+	int	(*ub_discard)(struct uufsd *, off_t, off_t);
+	void	(*ub_prefetch)(struct uufsd *, off_t, size_t);
+				/* run a whole list of reads or writes */
+	int	(*ub_submit)(struct uufsd *, struct ufs_io *, int, int write);
+};
+
+/*
+ * Block cache statistics, see bcache_stats().
+ */
+struct bcache_stats {
+	u_int64_t bs_hits;	/* reads served from memory */
+	u_int64_t bs_misses;	/* reads that had to go to the device */
+	u_int64_t bs_prefetches;	/* buffers read ahead of use */
+	u_int64_t bs_writes;	/* writes absorbed by the cache */
+	u_int64_t bs_writebacks;	/* dirty buffers written to the device */
+	u_int64_t bs_evictions;	/* buffers dropped to honour the budget */
+	size_t	bs_bytes;	/* memory currently held by buffers */
+	size_t	bs_limit;	/* memory budget */
+};
+
 /*
  * userland ufs disk.
  */
@@ -73,9 +132,8 @@ struct uufsd {
 	int d_fd;		/* raw device file descriptor */
 	long d_bsize;		/* device bsize */
 	ufs2_daddr_t d_sblock;	/* superblock location */
-	caddr_t d_inoblock;	/* inode block */
-	ino_t d_inomin;		/* low inode */
-	ino_t d_inomax;		/* high inode */
+	struct inocache *d_inocache;
+				/* cached inode blocks */
 	union {
 		struct fs d_fs;	/* filesystem information */
 		char d_sb[MAXBSIZE];
@@ -91,6 +149,12 @@ struct uufsd {
 	const char *d_error;	/* human readable disk error */
 	int d_mine;		/* internal flags */
 	time_t now;
+	struct bcache *d_cache;	/* block cache, NULL if disabled */
+	const struct ufs_backend *d_backend;
+				/* device I/O engine */
+	void *d_bkdata;		/* backend private data */
+	size_t d_align;		/* required I/O buffer alignment */
+	struct bufpool *d_pool;	/* free aligned buffers */
 #define	d_fs	d_sbunion.d_fs
 #define	d_sb	d_sbunion.d_sb
 #define	d_cg	d_cgunion.d_cg
@@ -102,11 +166,51 @@ __BEGIN_DECLS
  * libufs prototypes.
  */
 
+/*
+ * backend.c
+ */
+extern const struct ufs_backend ufs_pread_backend;
+const struct ufs_backend *ufs_backend_find(const char *);
+int ufs_disk_backend(struct uufsd *, const char *);
+long ufs_backend_optnum(const char *, const char *, long);
+
+/*
+ * bcache.c
+ */
+int bcache_init(struct uufsd *, size_t);
+void bcache_destroy(struct uufsd *);
+int bcache_flush(struct uufsd *);
+void bcache_invalidate(struct uufsd *, off_t, size_t);
+int bcache_peek(struct uufsd *, off_t, void *, size_t);
+void bcache_fill(struct uufsd *, off_t, void *, size_t);
+int bcache_prefetch(struct uufsd *, struct ufs_io *, int);
+ssize_t bcache_read(struct uufsd *, off_t, void *, size_t);
+ssize_t bcache_write(struct uufsd *, off_t, const void *, size_t);
+void bcache_stats(struct uufsd *, struct bcache_stats *);
+
 /*
  * block.c
  */
 ssize_t bread(struct uufsd *, ufs2_daddr_t, void *, size_t);
 ssize_t bwrite(struct uufsd *, ufs2_daddr_t, const void *, size_t);
+ssize_t pbread(struct uufsd *, off_t, void *, size_t);
+ssize_t pbwrite(struct uufsd *, off_t, const void *, size_t);
+ssize_t pbreadv(struct uufsd *, off_t, const struct iovec *, int);
+ssize_t pbwritev(struct uufsd *, off_t, const struct iovec *, int);
+int pbsubmit(struct uufsd *, struct ufs_io *, int, int);
+int ufs_io_contig(const struct ufs_io *, int, int);
+int bread_batch(struct uufsd *, struct ufs_io *, int);
+int bwrite_batch(struct uufsd *, struct ufs_io *, int);
+int bdiscard(struct uufsd *, ufs2_daddr_t, size_t);
+void bprefetch(struct uufsd *, ufs2_daddr_t, size_t);
+int bprefetch_batch(struct uufsd *, struct ufs_io *, int);
+
+/*
+ * bufpool.c
+ */
+void *ufs_buf_alloc(struct uufsd *, size_t);
+void ufs_buf_free(struct uufsd *, void *, size_t);
+void ufs_buf_drain(struct uufsd *);
 
 /*
  * cgroup.c
@@ -118,7 +222,30 @@ int cgwrite1(struct uufsd *, int);
 /*
  * inode.c
  */
+#define	INOCACHE_DEFAULT	64	/* inode blocks cached by default */
+int inocache_init(struct uufsd *, int, int);
+int inocache_flush(struct uufsd *);
+void inocache_destroy(struct uufsd *);
+void inocache_sync(struct uufsd *, off_t, const void *, size_t);
+int inocache_prefetch(struct uufsd *, const ino_t *, int);
+int inocache_tick(struct uufsd *);
 int getino(struct uufsd *, void **, ino_t, int *);
+int putino(struct uufsd *, ino_t);
+
+/*
+ * iouring.c
+ */
+extern const struct ufs_backend ufs_uring_backend;
+
+/*
+ * mapped.c
+ */
+extern const struct ufs_backend ufs_mapped_backend;
+
+/*
+ * ramdisk.c
+ */
+extern const struct ufs_backend ufs_ram_backend;
 
 /*
  * sblock.c
@@ -126,12 +253,19 @@ int getino(struct uufsd *, void **, ino_t, int *);
 int sbread(struct uufsd *);
 int sbwrite(struct uufsd *, int);
 
+/*
+ * slowdev.c
+ */
+extern const struct ufs_backend ufs_slow_backend;
+
 /*
  * type.c
  */
 int ufs_disk_close(struct uufsd *);
+int ufs_disk_directio(struct uufsd *);
 int ufs_disk_fillout(struct uufsd *, const char *);
 int ufs_disk_fillout_blank(struct uufsd *, const char *);
+int ufs_disk_sync(struct uufsd *);
 int ufs_disk_write(struct uufsd *);
 
 __END_DECLS
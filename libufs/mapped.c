@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Read-only mmap backend.
+ *
+ * The whole image is mapped at attach time and reads are a memcpy out
+ * of the mapping: no system call and no bounce buffer per block.  The
+ * host page cache already holds everything we touch, so the block
+ * cache is left disabled on top of this backend.  Writes fail with
+ * EROFS.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libufs.h>
+
+struct mapped {
+	char	*m_base;		/* start of the mapping */
+	size_t	m_size;			/* length of the image */
+};
+
+static int
+mapped_open(struct uufsd *disk, const char *args)
+{
+	struct mapped *m;
+	struct stat st;
+	off_t size;
+
+	ERROR(disk, NULL);
+
+	if (fstat(disk->d_fd, &st) == -1) {
+		ERROR(disk, "could not stat device");
+		return (-1);
+	}
+	if (S_ISREG(st.st_mode))
+		size = st.st_size;
+	else
+		size = lseek(disk->d_fd, 0, SEEK_END);
+	if (size <= 0) {
+		ERROR(disk, "could not size device for mapping");
+		return (-1);
+	}
+
+	m = malloc(sizeof(*m));
+	if (m == NULL) {
+		ERROR(disk, "unable to allocate mapping");
+		return (-1);
+	}
+	m->m_size = (size_t)size;
+	m->m_base = mmap(NULL, m->m_size, PROT_READ, MAP_SHARED, disk->d_fd, 0);
+	if (m->m_base == MAP_FAILED) {
+		free(m);
+		ERROR(disk, "could not map device");
+		return (-1);
+	}
+	disk->d_bkdata = m;
+	return (0);
+}
+
+static void
+mapped_close(struct uufsd *disk)
+{
+	struct mapped *m = disk->d_bkdata;
+
+	if (m == NULL)
+		return;
+	munmap(m->m_base, m->m_size);
+	free(m);
+	disk->d_bkdata = NULL;
+}
+
+static ssize_t
+mapped_read(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	struct mapped *m = disk->d_bkdata;
+
+	ERROR(disk, NULL);
+
+	if (off < 0 || (size_t)off > m->m_size || size > m->m_size - off) {
+		memset(data, 0, size);
+		ERROR(disk, "end of file from block device");
+		return (-1);
+	}
+	memcpy(data, m->m_base + off, size);
+	return (size);
+}
+
+static void
+mapped_prefetch(struct uufsd *disk, off_t off, size_t size)
+{
+	struct mapped *m = disk->d_bkdata;
+	size_t pgoff;
+
+	if (off < 0 || (size_t)off >= m->m_size)
+		return;
+	if (size > m->m_size - off)
+		size = m->m_size - off;
+	pgoff = off % getpagesize();
+	(void)madvise(m->m_base + off - pgoff, size + pgoff, MADV_WILLNEED);
+}
+
+const struct ufs_backend ufs_mapped_backend = {
+	.ub_name	= "mmap",
+	.ub_flags	= UB_NOCACHE,
+	.ub_open	= mapped_open,
+	.ub_close	= mapped_close,
+	.ub_read	= mapped_read,
+	.ub_prefetch	= mapped_prefetch,
+};
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * RAM disk backend.
+ *
+ * The whole image is read into anonymous memory at attach time and
+ * every block read and write after that is a memcpy.  Writes mark the
+ * RAM_CHUNK sized pieces they touch dirty; on flush (fsync, unmount)
+ * only the dirty runs are written back to the image, or, with
+ * writeback=0, nothing ever is and the changes die with the mount.
+ * Like mmap, the block cache is left disabled on top of this backend.
+ *
+ * Args:
+ *	huge=1		back the copy with huge pages if possible
+ *	writeback=0	throw writes away instead of writing them back
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libufs.h>
+
+#define	RAM_CHUNK	4096		/* dirty tracking granularity */
+#define	RAM_LOADSZ	(1 << 20)	/* image is loaded this much at a time */
+#define	RAM_HUGESZ	(2 << 20)	/* huge page size mappings round to */
+
+struct ramdisk {
+	char	*r_base;		/* copy of the image */
+	size_t	r_size;			/* length of the image */
+	size_t	r_mapsz;		/* length of the mapping */
+	u_char	*r_dirty;		/* one bit per RAM_CHUNK */
+	int	r_writeback;		/* write dirty chunks back on flush */
+};
+
+static void
+ram_free(struct ramdisk *r)
+{
+	if (r->r_base != NULL && r->r_base != MAP_FAILED)
+		munmap(r->r_base, r->r_mapsz);
+	free(r->r_dirty);
+	free(r);
+}
+
+static int
+ram_open(struct uufsd *disk, const char *args)
+{
+	struct ramdisk *r;
+	struct stat st;
+	off_t size;
+	size_t off, len;
+
+	ERROR(disk, NULL);
+
+	if (fstat(disk->d_fd, &st) == -1) {
+		ERROR(disk, "could not stat device");
+		return (-1);
+	}
+	if (S_ISREG(st.st_mode))
+		size = st.st_size;
+	else
+		size = lseek(disk->d_fd, 0, SEEK_END);
+	if (size <= 0) {
+		ERROR(disk, "could not size device for loading");
+		return (-1);
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		ERROR(disk, "unable to allocate RAM disk");
+		return (-1);
+	}
+	r->r_size = (size_t)size;
+	r->r_writeback = ufs_backend_optnum(args, "writeback", 1) != 0;
+	r->r_dirty = calloc(howmany(r->r_size, RAM_CHUNK * NBBY), 1);
+	if (r->r_dirty == NULL) {
+		ram_free(r);
+		ERROR(disk, "unable to allocate RAM disk");
+		return (-1);
+	}
+
+	r->r_base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (ufs_backend_optnum(args, "huge", 0)) {
+		r->r_mapsz = roundup(r->r_size, RAM_HUGESZ);
+		r->r_base = mmap(NULL, r->r_mapsz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (r->r_base == MAP_FAILED) {
+		r->r_mapsz = r->r_size;
+		r->r_base = mmap(NULL, r->r_mapsz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (r->r_base == MAP_FAILED) {
+			ram_free(r);
+			ERROR(disk, "unable to allocate RAM disk");
+			return (-1);
+		}
+#ifdef MADV_HUGEPAGE
+		/* No reserved huge pages: let the kernel collapse them. */
+		if (ufs_backend_optnum(args, "huge", 0))
+			(void)madvise(r->r_base, r->r_mapsz, MADV_HUGEPAGE);
+#endif
+	}
+
+	for (off = 0; off < r->r_size; off += len) {
+		len = MIN(r->r_size - off, RAM_LOADSZ);
+		if (ufs_pread_backend.ub_read(disk, off, r->r_base + off,
+		    len) == -1) {
+			ram_free(r);
+			ERROR(disk, "could not load device into memory");
+			return (-1);
+		}
+	}
+	disk->d_bkdata = r;
+	return (0);
+}
+
+static void
+ram_close(struct uufsd *disk)
+{
+	if (disk->d_bkdata != NULL)
+		ram_free(disk->d_bkdata);
+	disk->d_bkdata = NULL;
+}
+
+static ssize_t
+ram_read(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	struct ramdisk *r = disk->d_bkdata;
+
+	ERROR(disk, NULL);
+
+	if (off < 0 || (size_t)off > r->r_size || size > r->r_size - off) {
+		memset(data, 0, size);
+		ERROR(disk, "end of file from block device");
+		return (-1);
+	}
+	memcpy(data, r->r_base + off, size);
+	return (size);
+}
+
+static ssize_t
+ram_write(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
+	struct ramdisk *r = disk->d_bkdata;
+	size_t c;
+
+	ERROR(disk, NULL);
+
+	if (off < 0 || (size_t)off > r->r_size || size > r->r_size - off) {
+		ERROR(disk, "write past end of block device");
+		return (-1);
+	}
+	if (size == 0)
+		return (0);
+	memcpy(r->r_base + off, data, size);
+	for (c = off / RAM_CHUNK; c <= (off + size - 1) / RAM_CHUNK; c++)
+		setbit(r->r_dirty, c);
+	return (size);
+}
+
+/*
+ * Write the dirty chunks back to the image, a run of adjacent chunks
+ * at a time.
+ */
+static int
+ram_flush(struct uufsd *disk)
+{
+	struct ramdisk *r = disk->d_bkdata;
+	size_t c, i, end, nchunks, off, len;
+
+	ERROR(disk, NULL);
+
+	if (!r->r_writeback)
+		return (0);
+	nchunks = howmany(r->r_size, RAM_CHUNK);
+	for (c = 0; c < nchunks; c = end) {
+		if (isclr(r->r_dirty, c)) {
+			end = c + 1;
+			continue;
+		}
+		for (end = c; end < nchunks && isset(r->r_dirty, end); end++)
+			clrbit(r->r_dirty, end);
+		off = c * RAM_CHUNK;
+		len = MIN(end * RAM_CHUNK, r->r_size) - off;
+		if (ufs_pread_backend.ub_write(disk, off, r->r_base + off,
+		    len) == -1) {
+			/* Keep the run dirty for the next attempt. */
+			for (i = c; i < end; i++)
+				setbit(r->r_dirty, i);
+			ERROR(disk, "could not write back RAM disk");
+			return (-1);
+		}
+	}
+	return (ufs_pread_backend.ub_flush(disk));
+}
+
+const struct ufs_backend ufs_ram_backend = {
+	.ub_name	= "ram",
+	.ub_flags	= UB_NOCACHE,
+	.ub_open	= ram_open,
+	.ub_close	= ram_close,
+	.ub_read	= ram_read,
+	.ub_write	= ram_write,
+	.ub_flush	= ram_flush,
+};
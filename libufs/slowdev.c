@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2013 Manish Katiyar <mkatiyar@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistribution of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistribution in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Slow device emulation, for benchmarking on fast local storage.
+ *
+ * I/O goes to the image through the pread backend, but every request
+ * first sleeps for as long as a slow disk would take to serve it:
+ * a fixed latency plus random jitter, a seek penalty that grows with
+ * the distance from where the previous request ended, and the
+ * transfer time at a capped bandwidth.  A vectored request is one
+ * request, so merging blocks pays off the way it does on real disks.
+ * Every Nth request can also be made to fail with EIO.
+ *
+ * Args, all optional and 0 (off) by default:
+ *	latency=US	fixed cost of every request, in microseconds
+ *	jitter=US	random extra latency, up to US microseconds
+ *	seek=US		full-stroke seek time; a request pays the fraction
+ *			of it its distance is of the device size
+ *	bw=KB		bandwidth in KiB per second
+ *	fail=N		fail every Nth request
+ *	seed=N		seed for the jitter, so runs are reproducible
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/disklabel.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <ufsmount.h>
+#include <dinode.h>
+#include <fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libufs.h>
+
+struct slowdev {
+	long	s_latency;		/* microseconds per request */
+	long	s_jitter;		/* random extra microseconds */
+	long	s_seek;			/* full-stroke seek, microseconds */
+	long	s_bw;			/* KiB per second, 0 for unlimited */
+	long	s_fail;			/* fail every Nth request */
+	unsigned s_seed;		/* jitter state */
+	off_t	s_size;			/* device size, scales seeks */
+	off_t	s_head;			/* where the last request ended */
+	u_int64_t s_count;		/* requests so far */
+};
+
+static int
+slow_open(struct uufsd *disk, const char *args)
+{
+	struct slowdev *s;
+	struct stat st;
+
+	ERROR(disk, NULL);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		ERROR(disk, "unable to allocate slow device state");
+		return (-1);
+	}
+	s->s_latency = ufs_backend_optnum(args, "latency", 0);
+	s->s_jitter = ufs_backend_optnum(args, "jitter", 0);
+	s->s_seek = ufs_backend_optnum(args, "seek", 0);
+	s->s_bw = ufs_backend_optnum(args, "bw", 0);
+	s->s_fail = ufs_backend_optnum(args, "fail", 0);
+	s->s_seed = (unsigned)ufs_backend_optnum(args, "seed", 1);
+	if (s->s_latency < 0 || s->s_jitter < 0 || s->s_seek < 0 ||
+	    s->s_bw < 0 || s->s_fail < 0) {
+		free(s);
+		ERROR(disk, "invalid slow device parameters");
+		return (-1);
+	}
+
+	if (fstat(disk->d_fd, &st) == 0 && S_ISREG(st.st_mode))
+		s->s_size = st.st_size;
+	else
+		s->s_size = lseek(disk->d_fd, 0, SEEK_END);
+	if (s->s_size <= 0)
+		s->s_size = 1;
+	disk->d_bkdata = s;
+	return (0);
+}
+
+static void
+slow_close(struct uufsd *disk)
+{
+	free(disk->d_bkdata);
+	disk->d_bkdata = NULL;
+}
+
+/*
+ * Charge a request of size bytes at off.  Returns -1 with errno set if
+ * the request is one that should fail.
+ */
+static int
+slow_delay(struct uufsd *disk, off_t off, size_t size)
+{
+	struct slowdev *s = disk->d_bkdata;
+	struct timespec ts;
+	off_t dist;
+	double us;
+
+	us = s->s_latency;
+	if (s->s_jitter)
+		us += rand_r(&s->s_seed) % s->s_jitter;
+	if (s->s_seek && off != s->s_head) {
+		dist = off > s->s_head ? off - s->s_head : s->s_head - off;
+		if (dist > s->s_size)
+			dist = s->s_size;
+		us += (double)s->s_seek * dist / s->s_size;
+	}
+	if (s->s_bw)
+		us += (double)size * 1000000 / ((double)s->s_bw * 1024);
+	s->s_head = off + (off_t)size;
+
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)((us - (double)ts.tv_sec * 1000000) * 1000);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+
+	if (s->s_fail && ++s->s_count % s->s_fail == 0) {
+		errno = EIO;
+		ERROR(disk, "injected I/O error");
+		return (-1);
+	}
+	return (0);
+}
+
+static size_t
+slow_iovsize(const struct iovec *iov, int iovcnt)
+{
+	size_t size;
+	int i;
+
+	for (size = 0, i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	return (size);
+}
+
+static ssize_t
+slow_read(struct uufsd *disk, off_t off, void *data, size_t size)
+{
+	if (slow_delay(disk, off, size) == -1)
+		return (-1);
+	return (ufs_pread_backend.ub_read(disk, off, data, size));
+}
+
+static ssize_t
+slow_write(struct uufsd *disk, off_t off, const void *data, size_t size)
+{
+	if (slow_delay(disk, off, size) == -1)
+		return (-1);
+	return (ufs_pread_backend.ub_write(disk, off, data, size));
+}
+
+static ssize_t
+slow_readv(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	if (slow_delay(disk, off, slow_iovsize(iov, iovcnt)) == -1)
+		return (-1);
+	return (ufs_pread_backend.ub_readv(disk, off, iov, iovcnt));
+}
+
+static ssize_t
+slow_writev(struct uufsd *disk, off_t off, const struct iovec *iov, int iovcnt)
+{
+	if (slow_delay(disk, off, slow_iovsize(iov, iovcnt)) == -1)
+		return (-1);
+	return (ufs_pread_backend.ub_writev(disk, off, iov, iovcnt));
+}
+
+static int
+slow_flush(struct uufsd *disk)
+{
+	struct slowdev *s = disk->d_bkdata;
+
+	/* A cache flush costs a round trip but moves no head. */
+	if (slow_delay(disk, s->s_head, 0) == -1)
+		return (-1);
+	return (ufs_pread_backend.ub_flush(disk));
+}
+
+static int
+slow_discard(struct uufsd *disk, off_t off, off_t len)
+{
+	return (ufs_pread_backend.ub_discard(disk, off, len));
+}
+
+const struct ufs_backend ufs_slow_backend = {
+	.ub_name	= "slow",
+	.ub_open	= slow_open,
+	.ub_close	= slow_close,
+	.ub_read	= slow_read,
+	.ub_write	= slow_write,
+	.ub_readv	= slow_readv,
+	.ub_writev	= slow_writev,
+	.ub_flush	= slow_flush,
+	.ub_discard	= slow_discard,
+};
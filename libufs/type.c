@@ -25,6 +25,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define	_GNU_SOURCE	/* O_DIRECT */
+#endif
+
 #include <sys/cdefs.h>
 #include <sys/param.h>
 #include <sys/mount.h>
@@ -50,20 +54,56 @@
 #define	MINE_NAME	0x01
 /* Track if its fd points to a writable device. */
 #define	MINE_WRITE	0x02
+/* Track if its fd was opened with O_DIRECT. */
+#define	MINE_DIRECT	0x04
+
+/*
+ * Buffer alignment the device needs unless opened with O_DIRECT: some
+ * FreeBSD disk controllers want 64 bytes, Linux takes anything.
+ */
+#ifdef __FreeBSD__
+#define	DEF_ALIGN	64
+#else
+#define	DEF_ALIGN	1
+#endif
 
 int
 ufs_disk_close(struct uufsd *disk)
 {
+	const char *err = NULL;
+
+	/*
+	 * Write back what we can, but release everything even on failure:
+	 * the caller cannot retry once the disk is gone.  The first error
+	 * is the one reported.
+	 */
 	ERROR(disk, NULL);
-	close(disk->d_fd);
-	if (disk->d_inoblock != NULL) {
-		free(disk->d_inoblock);
-		disk->d_inoblock = NULL;
+	if (inocache_flush(disk) == -1)
+		err = "failed to write back inode blocks";
+	if (disk->d_cache != NULL) {
+		if (bcache_flush(disk) == -1 && err == NULL)
+			err = "failed to write back block cache";
+		bcache_destroy(disk);
 	}
+	/* Backends may hold writes of their own, e.g. the RAM disk. */
+	if ((disk->d_mine & MINE_WRITE) && disk->d_backend->ub_flush != NULL &&
+	    disk->d_backend->ub_flush(disk) == -1 && err == NULL)
+		err = "failed to write back device";
+	if (disk->d_backend->ub_close != NULL)
+		disk->d_backend->ub_close(disk);
+	disk->d_backend = &ufs_pread_backend;
+	disk->d_bkdata = NULL;
+	close(disk->d_fd);
+	inocache_destroy(disk);
+	ufs_buf_drain(disk);
 	if (disk->d_mine & MINE_NAME) {
 		free((char *)(uintptr_t)disk->d_name);
 		disk->d_name = NULL;
 	}
+	if (err != NULL) {
+		ERROR(disk, err);
+		return (-1);
+	}
 	return (0);
 }
 
@@ -143,9 +183,12 @@ again:	if ((ret = stat(name, &st)) < 0) {
 	disk->d_bsize = 1;
 	disk->d_ccg = 0;
 	disk->d_fd = fd;
-	disk->d_inoblock = NULL;
-	disk->d_inomin = 0;
-	disk->d_inomax = 0;
+	disk->d_inocache = NULL;
+	disk->d_cache = NULL;
+	disk->d_backend = &ufs_pread_backend;
+	disk->d_bkdata = NULL;
+	disk->d_align = DEF_ALIGN;
+	disk->d_pool = NULL;
 	disk->d_lcg = 0;
 	disk->d_mine = 0;
 	disk->d_ufs = 0;
@@ -164,9 +207,66 @@ again:	if ((ret = stat(name, &st)) < 0) {
 	return (0);
 }
 
+/*
+ * Push everything written so far down to stable storage: held back
+ * inode blocks and dirty cached blocks first, then whatever the backend
+ * buffers itself.
+ */
+int
+ufs_disk_sync(struct uufsd *disk)
+{
+	ERROR(disk, NULL);
+
+	if (inocache_flush(disk) == -1)
+		return (-1);
+	if (bcache_flush(disk) == -1)
+		return (-1);
+	if (disk->d_backend->ub_flush != NULL)
+		return (disk->d_backend->ub_flush(disk));
+	return (0);
+}
+
+/*
+ * Reopen the device with O_DIRECT, so that I/O bypasses the host page
+ * cache.  Buffers given to the device must then be aligned to d_align,
+ * which ufs_buf_alloc() guarantees; others get bounced.
+ */
+int
+ufs_disk_directio(struct uufsd *disk)
+{
+#ifdef O_DIRECT
+	int fd;
+
+	ERROR(disk, NULL);
+
+	if (disk->d_mine & MINE_DIRECT)
+		return (0);
+
+	fd = open(disk->d_name,
+	    ((disk->d_mine & MINE_WRITE) ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		ERROR(disk, "failed to open disk for direct I/O");
+		return (-1);
+	}
+	close(disk->d_fd);
+	disk->d_fd = fd;
+	disk->d_mine |= MINE_DIRECT;
+
+	/* Pooled buffers were aligned for the old requirement. */
+	ufs_buf_drain(disk);
+	disk->d_align = getpagesize();
+	return (0);
+#else
+	ERROR(disk, "direct I/O is not supported");
+	return (-1);
+#endif
+}
+
 int
 ufs_disk_write(struct uufsd *disk)
 {
+	int flags;
+
 	ERROR(disk, NULL);
 
 	if (disk->d_mine & MINE_WRITE)
@@ -174,7 +274,12 @@ ufs_disk_write(struct uufsd *disk)
 
 	close(disk->d_fd);
 
-	disk->d_fd = open(disk->d_name, O_RDWR);
+	flags = O_RDWR;
+#ifdef O_DIRECT
+	if (disk->d_mine & MINE_DIRECT)
+		flags |= O_DIRECT;
+#endif
+	disk->d_fd = open(disk->d_name, flags);
 	if (disk->d_fd < 0) {
 		ERROR(disk, "failed to open disk for writing");
 		return (-1);